@@ -0,0 +1,579 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "lc3.h"
+
+// Benchmark suite: runs synthetic guest programs, and any images given on
+// the command line, on every dispatch engine built in. Each case gets
+// warmup runs followed by timed repetitions; the report gives the median
+// and spread of the run time, instructions per second, ns per instruction
+// and the process RSS. --format=csv|json prints the same numbers for
+// comparing runs across commits.
+
+#define PRINT_ERROR(...) fprintf(stderr, "Error: " __VA_ARGS__)
+
+#define MAX_IMAGES 32
+#define IMAGE_BUDGET 1000000000ull
+
+typedef void (*run_fn)(lc3_vm *vm);
+typedef void (*load_fn)(lc3_vm *vm);
+
+enum
+{
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON
+};
+
+typedef struct
+{
+    const char *name;
+    load_fn load;
+    const char *image; // loaded from disk when load is NULL
+} workload;
+
+typedef struct
+{
+    int repeats;
+    int warmup;
+    int format;
+    const char *filter;
+    uint64_t budget; // instruction limit for image workloads
+} options;
+
+typedef struct
+{
+    uint64_t instructions;
+    int consistent; // every run retired the same number of instructions
+    int halted;
+    double min, median, mean, stddev;
+    long rss_kb, max_rss_kb;
+} result;
+
+// Instruction encoders for building guest code in place
+static uint16_t enc_add_imm(int dr, int sr, int imm) { return (OP_ADD << 12) | (dr << 9) | (sr << 6) | 0x20 | (imm & 0x1F); }
+static uint16_t enc_and_imm(int dr, int sr, int imm) { return (OP_AND << 12) | (dr << 9) | (sr << 6) | 0x20 | (imm & 0x1F); }
+static uint16_t enc_add_reg(int dr, int sr1, int sr2) { return (OP_ADD << 12) | (dr << 9) | (sr1 << 6) | sr2; }
+static uint16_t enc_not(int dr, int sr) { return (OP_NOT << 12) | (dr << 9) | (sr << 6) | 0x3F; }
+static uint16_t enc_ld(int dr, int off) { return (OP_LD << 12) | (dr << 9) | (off & 0x1FF); }
+static uint16_t enc_ldi(int dr, int off) { return (OP_LDI << 12) | (dr << 9) | (off & 0x1FF); }
+static uint16_t enc_st(int sr, int off) { return (OP_ST << 12) | (sr << 9) | (off & 0x1FF); }
+static uint16_t enc_sti(int sr, int off) { return (OP_STI << 12) | (sr << 9) | (off & 0x1FF); }
+static uint16_t enc_lea(int dr, int off) { return (OP_LEA << 12) | (dr << 9) | (off & 0x1FF); }
+static uint16_t enc_ldr(int dr, int base, int off) { return (OP_LDR << 12) | (dr << 9) | (base << 6) | (off & 0x3F); }
+static uint16_t enc_str(int sr, int base, int off) { return (OP_STR << 12) | (sr << 9) | (base << 6) | (off & 0x3F); }
+static uint16_t enc_br(int nzp, int off) { return (OP_BR << 12) | (nzp << 9) | (off & 0x1FF); }
+static uint16_t enc_jsr(int off) { return (OP_JSR << 12) | 0x800 | (off & 0x7FF); }
+static uint16_t enc_ret(void) { return (OP_JMP << 12) | (R_R7 << 6); }
+static uint16_t enc_trap(int vec) { return (OP_TRAP << 12) | vec; }
+
+// Nested counting loop mixing ALU, load/store and branches
+static void load_alu_loop(lc3_vm *vm)
+{
+    const uint16_t outer = 2000, inner = 5000;
+    uint16_t *m = vm->memory;
+    uint16_t pc = PC_START;
+
+    m[pc++] = enc_ld(R_R3, 13);           // x3000 LD R3, OUTER
+    uint16_t o1 = pc;
+    m[pc++] = enc_ld(R_R2, 13);           // x3001 LD R2, INNER
+    uint16_t i1 = pc;
+    m[pc++] = enc_add_reg(R_R5, R_R5, R_R2);
+    m[pc++] = enc_and_imm(R_R4, R_R5, 7);
+    m[pc++] = enc_lea(R_R6, 11);          // R6 = BUF
+    m[pc++] = enc_add_reg(R_R6, R_R6, R_R4);
+    m[pc++] = enc_str(R_R5, R_R6, 0);
+    m[pc++] = enc_ldr(R_R1, R_R6, 0);
+    m[pc++] = enc_not(R_R1, R_R1);
+    m[pc++] = enc_add_imm(R_R2, R_R2, -1);
+    m[pc] = enc_br(FL_POS, i1 - (pc + 1));
+    pc++;
+    m[pc++] = enc_add_imm(R_R3, R_R3, -1);
+    m[pc] = enc_br(FL_POS, o1 - (pc + 1));
+    pc++;
+    m[pc++] = enc_trap(TRAP_HALT);
+    m[pc++] = outer;                      // x300E OUTER
+    m[pc++] = inner;                      // x300F INNER
+}
+
+// Word-by-word LDR/STR copy of a 1K-word block, repeated
+static void load_memcpy(lc3_vm *vm)
+{
+    const uint16_t outer = 5000, count = 1024, src = 0x4000, dst = 0x5000;
+    uint16_t *m = vm->memory;
+    uint16_t pc = PC_START;
+
+    m[pc++] = enc_ld(R_R3, 12);           // x3000 LD R3, OUTER
+    uint16_t o1 = pc;
+    m[pc++] = enc_ld(R_R1, 12);           // x3001 LD R1, SRC
+    m[pc++] = enc_ld(R_R2, 12);           // x3002 LD R2, DST
+    m[pc++] = enc_ld(R_R4, 12);           // x3003 LD R4, COUNT
+    uint16_t i1 = pc;
+    m[pc++] = enc_ldr(R_R0, R_R1, 0);
+    m[pc++] = enc_str(R_R0, R_R2, 0);
+    m[pc++] = enc_add_imm(R_R1, R_R1, 1);
+    m[pc++] = enc_add_imm(R_R2, R_R2, 1);
+    m[pc++] = enc_add_imm(R_R4, R_R4, -1);
+    m[pc] = enc_br(FL_POS, i1 - (pc + 1));
+    pc++;
+    m[pc++] = enc_add_imm(R_R3, R_R3, -1);
+    m[pc] = enc_br(FL_POS, o1 - (pc + 1));
+    pc++;
+    m[pc++] = enc_trap(TRAP_HALT);
+    m[pc++] = outer;                      // x300D OUTER
+    m[pc++] = src;                        // x300E SRC
+    m[pc++] = dst;                        // x300F DST
+    m[pc++] = count;                      // x3010 COUNT
+
+    for (uint16_t i = 0; i < count; ++i)
+        m[src + i] = (uint16_t)(i * 40503u);
+}
+
+// Follows a 4K-node cycle scattered over memory through an LDI/ST cursor,
+// bumping a counter through LDI/STI at each step
+static void load_ptr_chase(lc3_vm *vm)
+{
+    const uint16_t outer = 1000, inner = 5000, nodes = 0x4000, counter = 0x5000;
+    uint16_t *m = vm->memory;
+    uint16_t pc = PC_START;
+
+    m[pc++] = enc_ld(R_R3, 11);           // x3000 LD R3, OUTER
+    uint16_t o1 = pc;
+    m[pc++] = enc_ld(R_R2, 11);           // x3001 LD R2, INNER
+    uint16_t i1 = pc;
+    m[pc++] = enc_ldi(R_R0, 11);          // x3002 LDI R0, CURSOR (next node)
+    m[pc++] = enc_st(R_R0, 10);           // x3003 ST R0, CURSOR
+    m[pc++] = enc_ldi(R_R1, 10);          // x3004 LDI R1, COUNTER
+    m[pc++] = enc_add_imm(R_R1, R_R1, 1);
+    m[pc++] = enc_sti(R_R1, 8);           // x3006 STI R1, COUNTER
+    m[pc++] = enc_add_imm(R_R2, R_R2, -1);
+    m[pc] = enc_br(FL_POS, i1 - (pc + 1));
+    pc++;
+    m[pc++] = enc_add_imm(R_R3, R_R3, -1);
+    m[pc] = enc_br(FL_POS, o1 - (pc + 1));
+    pc++;
+    m[pc++] = enc_trap(TRAP_HALT);
+    m[pc++] = outer;                      // x300C OUTER
+    m[pc++] = inner;                      // x300D INNER
+    m[pc++] = nodes;                      // x300E CURSOR
+    m[pc++] = counter;                    // x300F COUNTER
+
+    // 1237 is odd, so stepping by it visits all 4096 nodes before repeating
+    for (uint16_t i = 0; i < 0x1000; ++i)
+        m[nodes + i] = nodes + ((i + 1237) & 0xFFF);
+}
+
+// Recursive sum(n) = n + sum(n - 1) with R7 and n saved on an R6 stack
+static void load_recursion(lc3_vm *vm)
+{
+    const uint16_t outer = 4000, depth = 500, stack = 0xF000;
+    uint16_t *m = vm->memory;
+    uint16_t pc = PC_START;
+
+    m[pc++] = enc_ld(R_R6, 6);            // x3000 LD R6, STACK
+    m[pc++] = enc_ld(R_R3, 6);            // x3001 LD R3, OUTER
+    uint16_t o1 = pc;
+    m[pc++] = enc_ld(R_R0, 6);            // x3002 LD R0, DEPTH
+    m[pc++] = enc_jsr(6);                 // x3003 JSR SUM
+    m[pc++] = enc_add_imm(R_R3, R_R3, -1);
+    m[pc] = enc_br(FL_POS, o1 - (pc + 1));
+    pc++;
+    m[pc++] = enc_trap(TRAP_HALT);
+    m[pc++] = stack;                      // x3007 STACK
+    m[pc++] = outer;                      // x3008 OUTER
+    m[pc++] = depth;                      // x3009 DEPTH
+
+    uint16_t sum = pc;
+    m[pc++] = enc_add_imm(R_R0, R_R0, 0); // x300A SUM
+    m[pc++] = enc_br(FL_POS, 2);          // x300B BRp REC
+    m[pc++] = enc_and_imm(R_R1, R_R1, 0);
+    m[pc++] = enc_ret();
+    m[pc++] = enc_add_imm(R_R6, R_R6, -1); // x300E REC
+    m[pc++] = enc_str(R_R7, R_R6, 0);
+    m[pc++] = enc_add_imm(R_R6, R_R6, -1);
+    m[pc++] = enc_str(R_R0, R_R6, 0);
+    m[pc++] = enc_add_imm(R_R0, R_R0, -1);
+    m[pc] = enc_jsr(sum - (pc + 1));
+    pc++;
+    m[pc++] = enc_ldr(R_R0, R_R6, 0);
+    m[pc++] = enc_add_imm(R_R6, R_R6, 1);
+    m[pc++] = enc_add_reg(R_R1, R_R1, R_R0);
+    m[pc++] = enc_ldr(R_R7, R_R6, 0);
+    m[pc++] = enc_add_imm(R_R6, R_R6, 1);
+    m[pc++] = enc_ret();
+}
+
+// A PUTS of a short line and an OUT per iteration, output discarded
+static void load_trap_output(lc3_vm *vm)
+{
+    const uint16_t count = 20000;
+    const char *message = "The quick brown fox jumps over the lazy dog.";
+    uint16_t *m = vm->memory;
+    uint16_t pc = PC_START;
+
+    m[pc++] = enc_ld(R_R3, 7);            // x3000 LD R3, COUNT
+    uint16_t l1 = pc;
+    m[pc++] = enc_lea(R_R0, 8);           // x3001 LEA R0, MESSAGE
+    m[pc++] = enc_trap(TRAP_PUTS);
+    m[pc++] = enc_ld(R_R0, 5);            // x3003 LD R0, NEWLINE
+    m[pc++] = enc_trap(TRAP_OUT);
+    m[pc++] = enc_add_imm(R_R3, R_R3, -1);
+    m[pc] = enc_br(FL_POS, l1 - (pc + 1));
+    pc++;
+    m[pc++] = enc_trap(TRAP_HALT);
+    m[pc++] = count;                      // x3008 COUNT
+    m[pc++] = '\n';                       // x3009 NEWLINE
+    for (const char *c = message; *c; ++c)
+        m[pc++] = (uint16_t)*c;           // x300A MESSAGE
+    m[pc++] = 0;
+}
+
+// The same output written a character at a time through DSR/DDR
+static void load_ddr_output(lc3_vm *vm)
+{
+    const uint16_t count = 20000;
+    const char *message = "The quick brown fox jumps over the lazy dog.";
+    uint16_t *m = vm->memory;
+    uint16_t pc = PC_START;
+
+    m[pc++] = enc_ld(R_R3, 15);           // x3000 LD R3, COUNT
+    m[pc++] = enc_lea(R_R1, 18);          // x3001 LEA R1, MESSAGE
+    m[pc++] = enc_ldr(R_R0, R_R1, 0);     // x3002 next character
+    m[pc++] = enc_br(FL_ZRO, 5);          // end of string: newline
+    m[pc++] = enc_ldi(R_R2, 13);          // x3004 LDI R2, DSR
+    m[pc++] = enc_br(FL_ZRO | FL_POS, -2);
+    m[pc++] = enc_sti(R_R0, 12);          // x3006 STI R0, DDR
+    m[pc++] = enc_add_imm(R_R1, R_R1, 1);
+    m[pc++] = enc_br(FL_NEG | FL_ZRO | FL_POS, -7);
+    m[pc++] = enc_ld(R_R0, 7);            // x3009 LD R0, NEWLINE
+    m[pc++] = enc_ldi(R_R2, 7);           // x300A LDI R2, DSR
+    m[pc++] = enc_br(FL_ZRO | FL_POS, -2);
+    m[pc++] = enc_sti(R_R0, 6);           // x300C STI R0, DDR
+    m[pc++] = enc_add_imm(R_R3, R_R3, -1);
+    m[pc++] = enc_br(FL_POS, -14);
+    m[pc++] = enc_trap(TRAP_HALT);
+    m[pc++] = count;                      // x3010 COUNT
+    m[pc++] = '\n';                       // x3011 NEWLINE
+    m[pc++] = MR_DSR;                     // x3012 DSR
+    m[pc++] = MR_DDR;                     // x3013 DDR
+    for (const char *c = message; *c; ++c)
+        m[pc++] = (uint16_t)*c;           // x3014 MESSAGE
+    m[pc++] = 0;
+}
+
+// Busy-waits on KBSR with no input pending, like a guest waiting for a key
+static void load_kbsr_poll(lc3_vm *vm)
+{
+    const uint16_t outer = 200, inner = 5000;
+    uint16_t *m = vm->memory;
+    uint16_t pc = PC_START;
+
+    m[pc++] = enc_ld(R_R3, 8);            // x3000 LD R3, OUTER
+    uint16_t o1 = pc;
+    m[pc++] = enc_ld(R_R2, 8);            // x3001 LD R2, INNER
+    uint16_t p1 = pc;
+    m[pc++] = enc_ldi(R_R0, 8);           // x3002 LDI R0, KBSR
+    m[pc++] = enc_br(FL_NEG, 4);          // key ready: HALT
+    m[pc++] = enc_add_imm(R_R2, R_R2, -1);
+    m[pc] = enc_br(FL_POS, p1 - (pc + 1));
+    pc++;
+    m[pc++] = enc_add_imm(R_R3, R_R3, -1);
+    m[pc] = enc_br(FL_POS, o1 - (pc + 1));
+    pc++;
+    m[pc++] = enc_trap(TRAP_HALT);
+    m[pc++] = outer;                      // x3009 OUTER
+    m[pc++] = inner;                      // x300A INNER
+    m[pc++] = MR_KBSR;                    // x300B KBSR
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Resident set size now, from /proc where available
+static long current_rss_kb(void)
+{
+    long pages = -1, resident = -1;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f)
+    {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = -1;
+        fclose(f);
+    }
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static long max_rss_kb(void)
+{
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : -1;
+}
+
+// Put the VM in the workload's starting state. Returns 0 if an image
+// could not be loaded.
+static int prepare(lc3_vm *vm, const workload *w, const options *opt)
+{
+    lc3_reset(vm);
+    if (w->load)
+    {
+        w->load(vm);
+        return 1;
+    }
+    vm->instr_limit = opt->budget;
+    return lc3_load_image(vm, w->image);
+}
+
+static int bench(const workload *w, run_fn run, const options *opt, result *res)
+{
+    lc3_vm *vm = lc3_create();
+    double *times = malloc(opt->repeats * sizeof(double));
+    if (!vm || !times)
+    {
+        PRINT_ERROR("Out of memory\n");
+        exit(1);
+    }
+
+    // Keep guest output out of the report
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0)
+        lc3_out_init(vm, null_fd, LC3_FLUSH_BLOCK);
+
+    // Synthetic programs see an attached but idle keyboard, so KBSR polls
+    // find no key; images get end of input instead of blocking on GETC
+    if (w->load)
+        lc3_in_push(vm, "", 0);
+    else
+        lc3_in_close(vm);
+
+    int ok = 1;
+    memset(res, 0, sizeof(*res));
+    res->consistent = 1;
+    res->halted = 1;
+    for (int i = -opt->warmup; ok && i < opt->repeats; ++i)
+    {
+        ok = prepare(vm, w, opt);
+        if (!ok)
+        {
+            PRINT_ERROR("Failed to load image: %s\n", w->image);
+            break;
+        }
+        double start = now_seconds();
+        run(vm);
+        double elapsed = now_seconds() - start;
+        lc3_out_flush(vm);
+
+        if (i < 0)
+            continue;
+        times[i] = elapsed;
+        if (i > 0 && vm->instr_count != res->instructions)
+            res->consistent = 0;
+        res->instructions = vm->instr_count;
+        if (vm->status != LC3_STATUS_HALTED)
+            res->halted = 0;
+    }
+
+    if (ok)
+    {
+        double sum = 0, squares = 0;
+        for (int i = 0; i < opt->repeats; ++i)
+            sum += times[i];
+        res->mean = sum / opt->repeats;
+        for (int i = 0; i < opt->repeats; ++i)
+            squares += (times[i] - res->mean) * (times[i] - res->mean);
+        res->stddev = opt->repeats > 1 ? sqrt(squares / (opt->repeats - 1)) : 0;
+
+        qsort(times, opt->repeats, sizeof(double), compare_double);
+        res->min = times[0];
+        res->median = opt->repeats % 2 ? times[opt->repeats / 2]
+                                       : (times[opt->repeats / 2 - 1] + times[opt->repeats / 2]) / 2;
+        res->rss_kb = current_rss_kb();
+        res->max_rss_kb = max_rss_kb();
+    }
+
+    free(times);
+    lc3_destroy(vm);
+    if (null_fd >= 0)
+        close(null_fd);
+    return ok;
+}
+
+static const char *base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static void print_header(const options *opt)
+{
+    if (opt->format == FORMAT_CSV)
+    {
+        printf("workload,engine,instructions,repeats,min_s,median_s,mean_s,stddev_s,"
+               "minstr_per_s,ns_per_instr,rss_kb,max_rss_kb,halted,consistent\n");
+    }
+    else if (opt->format == FORMAT_JSON)
+    {
+        printf("{\n  \"repeats\": %d,\n  \"warmup\": %d,\n", opt->repeats, opt->warmup);
+#ifdef __VERSION__
+        printf("  \"compiler\": \"%s\",\n", __VERSION__);
+#endif
+        printf("  \"results\": [");
+    }
+    else
+    {
+        printf("%-14s %-10s %12s %9s %9s %7s %9s %8s %9s\n", "workload", "engine", "instr",
+               "median s", "min s", "stddev", "Minstr/s", "ns/instr", "rss KB");
+    }
+}
+
+static void print_result(const options *opt, const char *name, const char *engine, const result *r, int first)
+{
+    double rate = r->median > 0 ? r->instructions / r->median : 0;
+    double ns = r->instructions ? r->median * 1e9 / r->instructions : 0;
+
+    if (opt->format == FORMAT_CSV)
+    {
+        printf("%s,%s,%llu,%d,%.6f,%.6f,%.6f,%.6f,%.2f,%.4f,%ld,%ld,%d,%d\n", name, engine,
+               (unsigned long long)r->instructions, opt->repeats, r->min, r->median, r->mean,
+               r->stddev, rate / 1e6, ns, r->rss_kb, r->max_rss_kb, r->halted, r->consistent);
+    }
+    else if (opt->format == FORMAT_JSON)
+    {
+        printf("%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", \"instructions\": %llu, "
+               "\"min_s\": %.6f, \"median_s\": %.6f, \"mean_s\": %.6f, \"stddev_s\": %.6f, "
+               "\"minstr_per_s\": %.2f, \"ns_per_instr\": %.4f, \"rss_kb\": %ld, "
+               "\"max_rss_kb\": %ld, \"halted\": %s, \"consistent\": %s}",
+               first ? "" : ",", name, engine, (unsigned long long)r->instructions, r->min,
+               r->median, r->mean, r->stddev, rate / 1e6, ns, r->rss_kb, r->max_rss_kb,
+               r->halted ? "true" : "false", r->consistent ? "true" : "false");
+    }
+    else
+    {
+        printf("%-14s %-10s %12llu %9.4f %9.4f %6.1f%% %9.1f %8.3f %9ld%s\n", name, engine,
+               (unsigned long long)r->instructions, r->median, r->min,
+               r->median > 0 ? 100 * r->stddev / r->median : 0, rate / 1e6, ns, r->rss_kb,
+               !r->halted ? "  (did not halt)" : !r->consistent ? "  (instruction count varied)" : "");
+    }
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [image ...]\n"
+            "  --repeat=N        timed runs per case (default 5)\n"
+            "  --warmup=N        untimed runs before them (default 1)\n"
+            "  --format=FMT      text, csv or json (default text)\n"
+            "  --filter=TEXT     only workloads whose name contains TEXT\n"
+            "  --budget=N        instruction limit for images (default %llu)\n"
+            "Images are benchmarked after the built-in workloads.\n",
+            prog, IMAGE_BUDGET);
+}
+
+int main(int argc, char *argv[])
+{
+    options opt = {5, 1, FORMAT_TEXT, NULL, IMAGE_BUDGET};
+    workload workloads[7 + MAX_IMAGES] = {
+        {"alu-loop", load_alu_loop, NULL},
+        {"memcpy", load_memcpy, NULL},
+        {"ptr-chase", load_ptr_chase, NULL},
+        {"recursion", load_recursion, NULL},
+        {"trap-output", load_trap_output, NULL},
+        {"ddr-output", load_ddr_output, NULL},
+        {"kbsr-poll", load_kbsr_poll, NULL},
+    };
+    size_t count = 7;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--repeat=", 9) == 0)
+            opt.repeats = atoi(arg + 9);
+        else if (strncmp(arg, "--warmup=", 9) == 0)
+            opt.warmup = atoi(arg + 9);
+        else if (strncmp(arg, "--filter=", 9) == 0)
+            opt.filter = arg + 9;
+        else if (strncmp(arg, "--budget=", 9) == 0)
+            opt.budget = strtoull(arg + 9, NULL, 10);
+        else if (strcmp(arg, "--format=text") == 0)
+            opt.format = FORMAT_TEXT;
+        else if (strcmp(arg, "--format=csv") == 0)
+            opt.format = FORMAT_CSV;
+        else if (strcmp(arg, "--format=json") == 0)
+            opt.format = FORMAT_JSON;
+        else if (arg[0] == '-')
+        {
+            usage(argv[0]);
+            exit(2);
+        }
+        else if (count < sizeof(workloads) / sizeof(workloads[0]))
+        {
+            workloads[count].name = base_name(arg);
+            workloads[count].load = NULL;
+            workloads[count].image = arg;
+            ++count;
+        }
+        else
+        {
+            PRINT_ERROR("Too many images (at most %d)\n", MAX_IMAGES);
+            exit(2);
+        }
+    }
+    if (opt.repeats < 1 || opt.warmup < 0 || opt.budget == 0)
+    {
+        usage(argv[0]);
+        exit(2);
+    }
+
+    static const struct
+    {
+        const char *name;
+        run_fn run;
+    } engines[] = {
+        {"switch", lc3_run_switch},
+#ifdef LC3_HAVE_THREADED_DISPATCH
+#ifdef LC3_JIT
+        {"jit", lc3_run_threaded},
+#else
+        {"threaded", lc3_run_threaded},
+#endif
+#endif
+    };
+
+    int failed = 0, first = 1;
+    print_header(&opt);
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (opt.filter && !strstr(workloads[i].name, opt.filter))
+            continue;
+        for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e)
+        {
+            result r;
+            if (!bench(&workloads[i], engines[e].run, &opt, &r))
+            {
+                failed = 1;
+                continue;
+            }
+            print_result(&opt, workloads[i].name, engines[e].name, &r, first);
+            first = 0;
+        }
+    }
+    if (opt.format == FORMAT_JSON)
+        printf("\n  ]\n}\n");
+    return failed;
+}
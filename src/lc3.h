@@ -2,9 +2,27 @@
 #define LC3_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "lc3_api.h"
 
 #define MEMORY_MAX (1 << 16)
 
+// Memory is tracked in pages for dirty-page snapshot restore
+#define LC3_PAGE_SHIFT 8
+#define LC3_PAGE_SIZE (1 << LC3_PAGE_SHIFT) // in words
+#define LC3_PAGE_COUNT (MEMORY_MAX >> LC3_PAGE_SHIFT)
+
+// Per-page dirty bits, one for each consumer; stores set all of them
+enum
+{
+    LC3_DIRTY_SNAPSHOT = 1 << 0, // written since vm->snapshot_id matched
+    LC3_DIRTY_FORK = 1 << 1,     // differs from the shared fork image
+    LC3_DIRTY_OS = 1 << 2,       // system page written since the last trap (lc3_os.c)
+    LC3_DIRTY_ALL = 0xFF
+};
+
 // Registers
 enum
 {
@@ -65,13 +83,417 @@ enum
 enum
 {
     MR_KBSR = 0xFE00,
-    MR_KBDR = 0xFE02
+    MR_KBDR = 0xFE02,
+    MR_DSR = 0xFE04,
+    MR_DDR = 0xFE06,
+    MR_TMR = 0xFE08, // timer status, see lc3_bus.c
+    MR_TMI = 0xFE0A, // timer period
+    MR_PSR = 0xFFFC,
+    MR_MCR = 0xFFFE
+};
+
+// KBSR bits
+enum
+{
+    KBSR_READY = 1 << 15,
+    KBSR_IE = 1 << 14 // raise LC3_INT_KEYBOARD while a key is ready
+};
+
+// Processor status register, interrupts and exceptions (lc3_interrupt.c)
+#define PSR_USER 0x8000
+#define PSR_PRIORITY_MASK 0x0700
+#define LC3_INT_TABLE 0x0100 // interrupt vector table
+#define LC3_EXC_PRIVILEGE 0x00 // RTI in user mode
+#define LC3_EXC_ILLEGAL 0x01   // reserved opcode
+#define LC3_INT_KEYBOARD 0x80
+#define LC3_PRIORITY_KEYBOARD 4
+#define LC3_SSP_START 0x3000 // supervisor stack, grows down from here
+
+// Device registers live in the I/O page, LC3_IO_BASE up to the end of memory
+#define LC3_IO_BASE 0xFE00
+#define LC3_MAX_DEVICES 16
+#define LC3_TIMER_TICK 1000 // instructions per timer unit
+
+// Default program start address
+enum
+{
+    PC_START = 0x3000
+};
+
+// System space (trap and interrupt vector tables, OS code) ends here
+#define LC3_USER_BASE 0x3000
+
+// Pre-decoded instruction; handler is NULL until the word is first executed.
+// Entries are 16 bytes; the JIT clears them by index.
+typedef struct lc3_insn
+{
+    const void *handler;
+    uint8_t dr;
+    uint8_t sr1;
+    uint8_t sr2;
+    uint16_t imm; // sign-extended immediate, or absolute target for PC-relative forms
+    uint16_t instr; // the word itself, or an operand of the second word of a fused pair
+} lc3_insn;
+
+// Output flush policies
+enum
+{
+    LC3_FLUSH_IMMEDIATE = 0, // write at the end of every output trap
+    LC3_FLUSH_LINE,          // write once a newline has been buffered
+    LC3_FLUSH_BLOCK          // write when the buffer fills or has aged
 };
 
-// Function prototypes
+#define LC3_OUT_BUFFER_SIZE 4096 // must be a power of two
+#define LC3_OUT_FLUSH_MS 50
+#define LC3_OUT_CAPTURE (-1) // output fd that keeps everything in memory
+#define LC3_OUT_CALLBACK (-2) // output fd that hands flushed output to write
+
+// Guest console output, buffered in a ring and written with writev
+typedef struct lc3_output
+{
+    int fd;
+    int policy;
+    int newline;  // a newline was buffered since the last flush
+    size_t head;  // next byte to write out
+    size_t tail;  // next free slot; both only ever grow
+    uint64_t first_ms; // when the oldest pending byte was buffered
+    char *capture;      // with fd LC3_OUT_CAPTURE, flushed output collects here
+    lc3_output_fn write; // with fd LC3_OUT_CALLBACK
+    void *write_ctx;
+    size_t capture_len;
+    size_t capture_cap;
+    char buf[LC3_OUT_BUFFER_SIZE];
+} lc3_output;
+
+#define LC3_IN_BUFFER_SIZE 1024 // must be a power of two
+
+// Guest keyboard input, a lock-free single-producer/single-consumer ring
+typedef struct lc3_input
+{
+    int fd;
+    int attached;       // some producer feeds this ring
+    int thread_running;
+    pthread_t thread;
+    size_t head;        // consumer position (the VM)
+    size_t tail;        // producer position (reader thread or host)
+    int eof;
+    int waiting;        // consumer is blocked on ready
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    lc3_input_fn read;  // asked for a byte when the ring is empty, if set
+    void *read_ctx;
+    uint8_t buf[LC3_IN_BUFFER_SIZE];
+} lc3_input;
+
+// Performance counters, only present when built with LC3_PROFILE
+typedef struct lc3_profile
+{
+    uint64_t op[16];          // executed instructions per opcode
+    uint64_t trap[256];       // executed TRAPs per vector
+    uint64_t trap_ticks[256]; // time spent inside each trap routine
+    uint64_t br_taken;
+    uint64_t br_not_taken;
+    uint64_t kbsr_polls;
+} lc3_profile;
+
+#ifdef LC3_PROFILE
+#define LC3_PROF_INC(vm, counter) ((vm)->prof.counter++)
+#else
+#define LC3_PROF_INC(vm, counter) ((void)0)
+#endif
+
+// A memory-mapped device (lc3_bus.c). NULL handlers leave that direction,
+// and reset, to plain memory.
+typedef struct lc3_device
+{
+    const char *name;
+    uint16_t (*read)(lc3_vm *vm, uint16_t address, void *ctx);
+    void (*write)(lc3_vm *vm, uint16_t address, uint16_t value, void *ctx);
+    void (*reset)(lc3_vm *vm, void *ctx);
+    void *ctx;
+} lc3_device;
+
+typedef struct lc3_bus
+{
+    int count;
+    lc3_device devices[LC3_MAX_DEVICES];
+    uint8_t page[LC3_PAGE_COUNT];             // nonzero if any device is mapped in the page
+    uint8_t map[MEMORY_MAX - LC3_IO_BASE];    // device index + 1 per I/O address, 0 for none
+    uint64_t timer_next;                      // instr_count the timer fires at
+} lc3_bus;
+
+// Machine state for a single LC-3 instance. memory must stay the first
+// member: it is page-aligned so forked VMs can map it copy-on-write.
+struct lc3_vm
+{
+    uint16_t memory[MEMORY_MAX];
+    uint16_t reg[R_COUNT];
+    uint16_t cc; // last condition-code source while running, see update_flags
+    uint16_t psr; // PSR_USER and priority; the condition codes are in cc
+    uint16_t saved_ssp; // R6 of the mode not running
+    uint16_t saved_usp;
+    uint64_t instr_count;
+    uint64_t instr_limit; // stop once instr_count reaches this, checked at branches
+    uint64_t deadline_ns; // CLOCK_MONOTONIC time to stop at, 0 for none
+    int running;
+    int status; // LC3_STATUS_*
+    lc3_insn *decoded; // lazily allocated decode cache, one entry per address
+    struct lc3_jit *jit; // translated blocks, NULL unless built with LC3_JIT
+    uint64_t snapshot_id; // snapshot memory last matched, 0 if none
+    uint8_t dirty[LC3_PAGE_COUNT]; // LC3_DIRTY_* bits per page
+    struct lc3_cow *cow; // shared memory image this VM maps, NULL if none
+    struct lc3_sampler *sampler; // NULL unless sampling
+    struct lc3_tracer *tracer; // NULL unless tracing
+    struct lc3_input_log *input_log; // NULL unless recording or replaying input
+    struct lc3_os *os; // NULL unless TRAPs go through the guest's vector table
+    lc3_bus bus;
+    lc3_output out;
+    lc3_input in;
+#ifdef LC3_PROFILE
+    lc3_profile prof;
+#endif
+};
+
+// Function prototypes; the embedding API is in lc3_api.h
 void lc3_init(void);
-int lc3_load_image(const char *image_path);
-void lc3_run(void);
 void lc3_cleanup(void);
+void lc3_copy_be16(uint16_t *dst, const uint8_t *src, size_t count);
+void lc3_run(lc3_vm *vm);
+
+// Dispatch engines; lc3_run uses the one selected at build time
+#if defined(__GNUC__)
+#define LC3_HAVE_THREADED_DISPATCH 1
+#endif
+
+void lc3_run_switch(lc3_vm *vm);
+#ifdef LC3_HAVE_THREADED_DISPATCH
+void lc3_run_threaded(lc3_vm *vm);
+#endif
+
+// Core helpers, inlined into the dispatch loops
+static inline uint16_t sign_extend(uint16_t x, int bit_count)
+{
+    if ((x >> (bit_count - 1)) & 1)
+    {
+        x |= (0xFFFF << bit_count);
+    }
+    return x;
+}
+
+static inline uint16_t swap16(uint16_t x)
+{
+    return (x << 8) | (x >> 8);
+}
+
+// Condition codes are evaluated lazily: instructions only record the last
+// result in vm->cc, and N/Z/P are derived when a BR needs them. R_COND is
+// materialised from cc when lc3_run returns and read back when it starts.
+static inline uint16_t cond_flags(uint16_t result)
+{
+    return result == 0 ? FL_ZRO : (result >> 15) ? FL_NEG : FL_POS;
+}
+
+static inline void update_flags(lc3_vm *vm, uint16_t r)
+{
+    vm->cc = vm->reg[r];
+}
+
+void lc3_cond_load(lc3_vm *vm);
+void lc3_cond_save(lc3_vm *vm);
+
+// Memory access (lc3_memory.c)
+uint16_t mem_read(lc3_vm *vm, uint16_t address);
+void mem_write(lc3_vm *vm, uint16_t address, uint16_t val);
+void lc3_invalidate_decoded(lc3_vm *vm);
+void lc3_mem_load_be16(lc3_vm *vm, uint16_t address, const uint8_t *src, size_t count);
+size_t lc3_mem_scan(const lc3_vm *vm, uint16_t address, size_t limit);
+
+// How many of count words from address come before the wrap to 0x0000
+static inline size_t lc3_mem_run(uint16_t address, size_t count)
+{
+    size_t room = MEMORY_MAX - (size_t)address;
+    return count < room ? count : room;
+}
+
+int lc3_interrupted(void);
+int lc3_events_pending(void);
+int lc3_take_sample_request(void);
+int lc3_sample_timer(int hz);
+
+static inline void lc3_mark_dirty(lc3_vm *vm, uint16_t address)
+{
+    vm->dirty[address >> LC3_PAGE_SHIFT] = LC3_DIRTY_ALL;
+}
+
+// Memory-mapped device bus (lc3_bus.c)
+void lc3_bus_init(lc3_vm *vm);
+void lc3_bus_reset(lc3_vm *vm);
+int lc3_bus_attach(lc3_vm *vm, uint16_t first, uint16_t last, const lc3_device *dev);
+uint16_t lc3_bus_read(lc3_vm *vm, uint16_t address);
+int lc3_bus_write(lc3_vm *vm, uint16_t address, uint16_t value);
+
+// True if address may be claimed by a device; the engines send these
+// accesses through mem_read and mem_write
+static inline int lc3_is_device(const lc3_vm *vm, uint16_t address)
+{
+    return vm->bus.page[address >> LC3_PAGE_SHIFT];
+}
+
+int lc3_keyboard_ready(lc3_vm *vm);
+int lc3_keyboard_getc(lc3_vm *vm);
+
+// Privilege modes and interrupts (lc3_interrupt.c)
+uint16_t lc3_psr(const lc3_vm *vm);
+void lc3_set_psr(lc3_vm *vm, uint16_t psr);
+void lc3_raise(lc3_vm *vm, uint8_t vector, int priority);
+void lc3_exception(lc3_vm *vm, uint8_t vector);
+int lc3_deliver_interrupts(lc3_vm *vm);
+
+// Guest-OS traps (lc3_os.c)
+enum
+{
+    LC3_OS_GUEST = -1,     // run the guest's routine
+    LC3_OS_BAD_TRAP = 0x100 // the built-in OS's handler for unassigned vectors
+};
+
+int lc3_os_enable(lc3_vm *vm);
+void lc3_os_disable(lc3_vm *vm);
+int lc3_os_install(lc3_vm *vm);
+int lc3_os_native(lc3_vm *vm, uint8_t vector);
+
+// Machine snapshots (lc3_snapshot.c). Save and restore only between runs.
+typedef struct lc3_snapshot lc3_snapshot;
+
+lc3_snapshot *lc3_snapshot_save(lc3_vm *vm);
+int lc3_snapshot_restore(lc3_vm *vm, const lc3_snapshot *snap);
+void lc3_snapshot_free(lc3_snapshot *snap);
+int lc3_snapshot_write(const lc3_snapshot *snap, const char *path);
+lc3_snapshot *lc3_snapshot_read(const char *path);
+
+// Copy-on-write VM forks (lc3_fork.c); lc3_fork is in lc3_api.h
+void lc3_fork_release(lc3_vm *vm);
+
+// Buffered console output (lc3_io.c)
+void lc3_out_init(lc3_vm *vm, int fd, int policy);
+void lc3_out_putc(lc3_vm *vm, char c);
+void lc3_out_write(lc3_vm *vm, const char *s, size_t len);
+char *lc3_out_reserve(lc3_vm *vm, size_t *room);
+void lc3_out_commit(lc3_vm *vm, size_t len);
+void lc3_out_sync(lc3_vm *vm);
+
+// Keyboard input (lc3_input.c)
+void lc3_in_init(lc3_vm *vm);
+int lc3_in_start(lc3_vm *vm, int fd);
+void lc3_in_stop(lc3_vm *vm);
+int lc3_in_poll(lc3_vm *vm);
+int lc3_in_getc(lc3_vm *vm);
+int lc3_in_take(lc3_vm *vm);
+int lc3_in_wait(lc3_vm *vm);
+
+// Input record/replay (lc3_replay.c)
+enum
+{
+    LC3_INPUT_POLL = 1, // KBSR poll that found a key
+    LC3_INPUT_GETC,     // GETC or IN
+    LC3_INPUT_EOF       // input ended
+};
+
+int lc3_record_input(lc3_vm *vm, const char *path);
+int lc3_replay_input(lc3_vm *vm, const char *path);
+int lc3_input_log_close(lc3_vm *vm);
+int lc3_input_log_read(lc3_vm *vm, int kind);
+
+// Profile reports (lc3_profile.c); empty unless built with LC3_PROFILE
+uint64_t lc3_profile_ticks(void);
+void lc3_profile_report(lc3_vm *vm, FILE *f, int json);
+
+// Sampling profiler (lc3_sampler.c)
+int lc3_sampler_enable(lc3_vm *vm, uint64_t interval);
+void lc3_sampler_disable(lc3_vm *vm);
+void lc3_sampler_call(lc3_vm *vm, uint16_t target);
+void lc3_sampler_return(lc3_vm *vm);
+uint64_t lc3_sample_tick(lc3_vm *vm, uint64_t count, int requested);
+int lc3_symbols_load(lc3_vm *vm, const char *path);
+int lc3_sampler_write_folded(lc3_vm *vm, FILE *f);
+void lc3_sampler_report(lc3_vm *vm, FILE *f, int top);
+
+// Execution traces (lc3_trace.c)
+#define LC3_TRACE_MAX_STORES 16 // per instruction; further stores are not recorded
+
+typedef struct lc3_trace_reader lc3_trace_reader;
+
+// One decoded instruction; reg and flags are the state after it ran
+typedef struct lc3_trace_record
+{
+    uint64_t index; // instr_count after the instruction
+    uint16_t pc;
+    uint16_t instr;
+    uint16_t reg[8];
+    uint8_t flags;   // FL_*
+    uint8_t written; // bit per register the instruction changed
+    int store_count;
+    uint16_t store_address[LC3_TRACE_MAX_STORES];
+    uint16_t store_value[LC3_TRACE_MAX_STORES];
+} lc3_trace_record;
+
+int lc3_trace_start(lc3_vm *vm, const char *path);
+int lc3_trace_stop(lc3_vm *vm);
+void lc3_trace_sync(lc3_vm *vm);
+void lc3_trace_step(lc3_vm *vm, uint16_t pc, uint16_t instr);
+void lc3_trace_store(lc3_vm *vm, uint16_t address, uint16_t value);
+lc3_trace_reader *lc3_trace_open(const char *path);
+int lc3_trace_next(lc3_trace_reader *r, lc3_trace_record *rec);
+void lc3_trace_close(lc3_trace_reader *r);
+
+// Batch runner (lc3_batch.c)
+typedef struct lc3_job
+{
+    char **images;
+    int image_count;
+    char *input;    // file fed to the keyboard, NULL for none
+    uint64_t budget; // instruction limit, 0 for none
+    uint64_t timeout_ms; // wall-clock limit, 0 for none
+    int status;     // results, LC3_STATUS_*
+    uint64_t instr_count;
+    char *output;
+    size_t output_len;
+} lc3_job;
+
+int lc3_batch_load(const char *path, lc3_job **jobs, size_t *count);
+int lc3_batch_run(lc3_job *jobs, size_t count, int workers);
+void lc3_batch_free(lc3_job *jobs, size_t count);
+
+// Basic-block JIT for x86-64 (lc3_jit.c, built with LC3_JIT)
+struct lc3_jit *lc3_jit_create(void);
+void lc3_jit_destroy(struct lc3_jit *jit);
+void lc3_jit_flush(struct lc3_jit *jit);
+void lc3_jit_invalidate(struct lc3_jit *jit, uint16_t address);
+uint64_t lc3_jit_run(lc3_vm *vm, uint64_t budget);
+
+// Instruction execution functions
+void exec_add(lc3_vm *vm, uint16_t instr);
+void exec_and(lc3_vm *vm, uint16_t instr);
+void exec_not(lc3_vm *vm, uint16_t instr);
+void exec_br(lc3_vm *vm, uint16_t instr);
+void exec_jmp(lc3_vm *vm, uint16_t instr);
+void exec_jsr(lc3_vm *vm, uint16_t instr);
+void exec_ld(lc3_vm *vm, uint16_t instr);
+void exec_ldi(lc3_vm *vm, uint16_t instr);
+void exec_ldr(lc3_vm *vm, uint16_t instr);
+void exec_lea(lc3_vm *vm, uint16_t instr);
+void exec_st(lc3_vm *vm, uint16_t instr);
+void exec_sti(lc3_vm *vm, uint16_t instr);
+void exec_str(lc3_vm *vm, uint16_t instr);
+void exec_trap(lc3_vm *vm, uint16_t instr);
+void exec_rti(lc3_vm *vm, uint16_t instr);
+
+// Trap routines
+void trap_getc(lc3_vm *vm);
+void trap_out(lc3_vm *vm);
+void trap_puts(lc3_vm *vm);
+void trap_in(lc3_vm *vm);
+void trap_putsp(lc3_vm *vm);
+void trap_halt(lc3_vm *vm);
+void trap_bad(lc3_vm *vm);
 
 #endif // LC3_H
\ No newline at end of file
@@ -0,0 +1,52 @@
+#include "lc3.h"
+
+// Accessors for the embedding API (lc3_api.h) that do not belong to any
+// one subsystem. They are only meaningful between runs, when R_COND holds
+// the condition codes.
+
+// The public register numbers index vm->reg directly
+typedef char lc3_reg_numbers_match[(int)LC3_REG_PC == (int)R_PC && (int)LC3_REG_COND == (int)R_COND ? 1 : -1];
+
+int lc3_status(const lc3_vm *vm)
+{
+    return vm->status;
+}
+
+uint64_t lc3_instr_count(const lc3_vm *vm)
+{
+    return vm->instr_count;
+}
+
+uint16_t lc3_get_reg(const lc3_vm *vm, int reg)
+{
+    if (reg >= 0 && reg < R_COUNT)
+    {
+        return vm->reg[reg];
+    }
+    return reg == LC3_REG_PSR ? lc3_psr(vm) : 0;
+}
+
+void lc3_set_reg(lc3_vm *vm, int reg, uint16_t value)
+{
+    switch (reg)
+    {
+    case LC3_REG_COND:
+        lc3_set_psr(vm, (lc3_psr(vm) & ~(FL_NEG | FL_ZRO | FL_POS)) | (value & (FL_NEG | FL_ZRO | FL_POS)));
+        break;
+    case LC3_REG_PSR:
+        // As a store to the PSR register: R6 stays as it is
+        lc3_set_psr(vm, value);
+        break;
+    default:
+        if (reg >= 0 && reg < R_COND)
+        {
+            vm->reg[reg] = value;
+        }
+        break;
+    }
+}
+
+const uint16_t *lc3_memory(const lc3_vm *vm)
+{
+    return vm->memory;
+}
@@ -0,0 +1,119 @@
+#ifndef LC3_API_H
+#define LC3_API_H
+
+// Embedding API for liblc3.
+//
+// Each lc3_vm is an independent machine. Nothing here touches the terminal
+// or installs signal handlers (that is lc3_init, for the command-line VM),
+// and nothing reads stdin: the guest sees only input handed over with
+// lc3_in_push or an input callback, and sees end of input once neither has
+// anything left. Output goes to stdout until lc3_set_output redirects it.
+// A VM may be driven from any thread, but only from one at a time.
+//
+// lc3_api.hpp wraps this in a C++ class.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// liblc3 is built with hidden visibility; only these functions are exported
+#if defined(__GNUC__)
+#define LC3_API __attribute__((visibility("default")))
+#else
+#define LC3_API
+#endif
+
+typedef struct lc3_vm lc3_vm;
+
+// Why the last run stopped
+enum
+{
+    LC3_STATUS_RUNNING = 0,
+    LC3_STATUS_HALTED,      // TRAP HALT
+    LC3_STATUS_BUDGET,      // instruction limit reached
+    LC3_STATUS_PAUSED,      // lc3_run_for slice used up; run again to resume
+    LC3_STATUS_DEADLINE,    // lc3_set_timeout expired
+    LC3_STATUS_INTERRUPTED, // SIGINT
+    LC3_STATUS_BAD_OPCODE,
+    LC3_STATUS_BAD_TRAP,
+    LC3_STATUS_ERROR        // host-side failure, e.g. out of memory
+};
+
+// Registers for lc3_get_reg and lc3_set_reg; R0 to R7 are 0 to 7
+enum
+{
+    LC3_REG_PC = 8,
+    LC3_REG_COND = 9, // FL_POS, FL_ZRO or FL_NEG
+    LC3_REG_PSR = 10, // privilege, priority and condition codes
+    LC3_REG_COUNT
+};
+
+// Called with output as the guest's output is flushed
+typedef void (*lc3_output_fn)(void *ctx, const char *data, size_t len);
+
+// Called when the guest wants a key and none was pushed; returns the next
+// byte, or -1 to end input
+typedef int (*lc3_input_fn)(void *ctx);
+
+// Lifecycle. lc3_reset clears memory and registers but keeps the I/O setup.
+LC3_API lc3_vm *lc3_create(void);
+LC3_API void lc3_destroy(lc3_vm *vm);
+LC3_API void lc3_reset(lc3_vm *vm);
+
+// A new VM in the current state of vm, which must not be running. They
+// share memory pages until either writes one. The child's output goes
+// where vm's does, to the same callback; it starts with no input.
+// Returns NULL on failure.
+LC3_API lc3_vm *lc3_fork(lc3_vm *vm);
+
+// Load an object file (origin word, then the words to put there) or an
+// LC3M container. Return 0 if the image is malformed.
+LC3_API int lc3_load_buffer(lc3_vm *vm, const void *data, size_t size);
+LC3_API int lc3_load_image(lc3_vm *vm, const char *image_path);
+
+// Execution. Each call returns the status, also kept for lc3_status.
+// lc3_step runs exactly one instruction; lc3_run_for about n (the JIT does
+// not cut a translated block short).
+LC3_API int lc3_run_for(lc3_vm *vm, uint64_t n);
+LC3_API int lc3_step(lc3_vm *vm);
+LC3_API void lc3_set_timeout(lc3_vm *vm, uint64_t ms);
+LC3_API int lc3_status(const lc3_vm *vm);
+LC3_API const char *lc3_status_name(int status);
+LC3_API uint64_t lc3_instr_count(const lc3_vm *vm);
+
+// Registers, between runs. Returns 0 for an unknown register.
+LC3_API uint16_t lc3_get_reg(const lc3_vm *vm, int reg);
+LC3_API void lc3_set_reg(lc3_vm *vm, int reg, uint16_t value);
+
+// Memory. lc3_memory is a read-only view of all MEMORY_MAX words, valid
+// until lc3_destroy; device registers read as they were last stored. The
+// block functions wrap from 0xFFFF to 0x0000 and bypass devices. Write
+// only between runs.
+LC3_API const uint16_t *lc3_memory(const lc3_vm *vm);
+LC3_API void lc3_mem_read_block(const lc3_vm *vm, uint16_t address, uint16_t *dst, size_t count);
+LC3_API void lc3_mem_write_block(lc3_vm *vm, uint16_t address, const uint16_t *src, size_t count);
+
+// Output. lc3_set_output sends it to fn, or with fn NULL keeps it for
+// lc3_out_take, whose result the caller frees. Every run flushes before
+// it returns.
+LC3_API void lc3_set_output(lc3_vm *vm, lc3_output_fn fn, void *ctx);
+LC3_API int lc3_out_flush(lc3_vm *vm);
+LC3_API char *lc3_out_take(lc3_vm *vm, size_t *len);
+
+// Input. lc3_in_push queues bytes (returning how many fit) and
+// lc3_in_close ends input once they are read. An input callback is asked
+// whenever the queue is empty. lc3_in_reset drops queued input, the
+// callback and the end of input, for reusing a VM after lc3_reset.
+LC3_API size_t lc3_in_push(lc3_vm *vm, const void *data, size_t len);
+LC3_API void lc3_in_close(lc3_vm *vm);
+LC3_API void lc3_set_input(lc3_vm *vm, lc3_input_fn fn, void *ctx);
+LC3_API void lc3_in_reset(lc3_vm *vm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LC3_API_H
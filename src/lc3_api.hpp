@@ -0,0 +1,164 @@
+#ifndef LC3_API_HPP
+#define LC3_API_HPP
+
+// Header-only C++11 wrapper for lc3_api.h. lc3::Vm owns one VM and can be
+// moved but not copied; the VM is destroyed with it. A new Vm keeps its
+// output for take_output until on_output routes it elsewhere. Callbacks run
+// inside the C library and must not throw.
+
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+
+#include "lc3_api.h"
+
+namespace lc3
+{
+
+class Vm
+{
+public:
+    typedef std::function<void(const char *, size_t)> OutputFn;
+    typedef std::function<int()> InputFn;
+
+    Vm() : vm_(lc3_create())
+    {
+        if (!vm_)
+            throw std::bad_alloc();
+        lc3_set_output(vm_, nullptr, nullptr);
+    }
+
+    ~Vm()
+    {
+        if (vm_)
+            lc3_destroy(vm_);
+    }
+
+    // The callbacks are held through unique_ptr so the context pointers
+    // given to the C API survive moves
+    Vm(Vm &&other) noexcept
+        : vm_(other.vm_), output_(std::move(other.output_)), input_(std::move(other.input_))
+    {
+        other.vm_ = nullptr;
+    }
+
+    Vm &operator=(Vm &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (vm_)
+                lc3_destroy(vm_);
+            vm_ = other.vm_;
+            output_ = std::move(other.output_);
+            input_ = std::move(other.input_);
+            other.vm_ = nullptr;
+        }
+        return *this;
+    }
+
+    Vm(const Vm &) = delete;
+    Vm &operator=(const Vm &) = delete;
+
+    lc3_vm *get() const noexcept { return vm_; }
+
+    // A copy-on-write child in this VM's state (see lc3_fork) with its own
+    // copy of the output callback
+    Vm fork() const
+    {
+        lc3_vm *child = lc3_fork(vm_);
+        if (!child)
+            throw std::bad_alloc();
+        Vm vm(child);
+        if (output_)
+            vm.on_output(*output_);
+        return vm;
+    }
+
+    void reset() { lc3_reset(vm_); }
+    bool load(const void *data, size_t size) { return lc3_load_buffer(vm_, data, size) != 0; }
+    bool load_file(const std::string &path) { return lc3_load_image(vm_, path.c_str()) != 0; }
+
+    int run_for(uint64_t n) { return lc3_run_for(vm_, n); }
+    int step() { return lc3_step(vm_); }
+    void set_timeout(uint64_t ms) { lc3_set_timeout(vm_, ms); }
+    int status() const { return lc3_status(vm_); }
+    const char *status_name() const { return lc3_status_name(lc3_status(vm_)); }
+    uint64_t instr_count() const { return lc3_instr_count(vm_); }
+
+    uint16_t reg(int r) const { return lc3_get_reg(vm_, r); }
+    void set_reg(int r, uint16_t value) { lc3_set_reg(vm_, r, value); }
+    uint16_t pc() const { return lc3_get_reg(vm_, LC3_REG_PC); }
+    void set_pc(uint16_t pc) { lc3_set_reg(vm_, LC3_REG_PC, pc); }
+
+    // All MEMORY_MAX words, read-only; see lc3_memory
+    const uint16_t *memory() const { return lc3_memory(vm_); }
+    uint16_t peek(uint16_t address) const { return lc3_memory(vm_)[address]; }
+    void poke(uint16_t address, uint16_t value) { lc3_mem_write_block(vm_, address, &value, 1); }
+    void read(uint16_t address, uint16_t *dst, size_t count) const { lc3_mem_read_block(vm_, address, dst, count); }
+    void write(uint16_t address, const uint16_t *src, size_t count) { lc3_mem_write_block(vm_, address, src, count); }
+
+    size_t push_input(const std::string &s) { return lc3_in_push(vm_, s.data(), s.size()); }
+    void close_input() { lc3_in_close(vm_); }
+
+    // Drop queued input, the input callback and any end of input
+    void reset_input()
+    {
+        lc3_in_reset(vm_);
+        input_.reset();
+    }
+
+    // Output kept since the last call, when no output callback is set
+    std::string take_output()
+    {
+        size_t len;
+        char *data = lc3_out_take(vm_, &len);
+        std::string s(data ? data : "", data ? len : 0);
+        std::free(data);
+        return s;
+    }
+
+    // An empty fn goes back to keeping output for take_output
+    void on_output(OutputFn fn)
+    {
+        if (!fn)
+        {
+            lc3_set_output(vm_, nullptr, nullptr);
+            output_.reset();
+            return;
+        }
+        // Output still buffered goes to the old callback
+        std::unique_ptr<OutputFn> next(new OutputFn(std::move(fn)));
+        lc3_set_output(vm_, call_output, next.get());
+        output_ = std::move(next);
+    }
+
+    // fn returns the next byte, or -1 to end input
+    void on_input(InputFn fn)
+    {
+        if (!fn)
+        {
+            lc3_set_input(vm_, nullptr, nullptr);
+            input_.reset();
+            return;
+        }
+        std::unique_ptr<InputFn> next(new InputFn(std::move(fn)));
+        lc3_set_input(vm_, call_input, next.get());
+        input_ = std::move(next);
+    }
+
+private:
+    explicit Vm(lc3_vm *vm) noexcept : vm_(vm) {}
+
+    static void call_output(void *ctx, const char *data, size_t len) { (*static_cast<OutputFn *>(ctx))(data, len); }
+    static int call_input(void *ctx) { return (*static_cast<InputFn *>(ctx))(); }
+
+    lc3_vm *vm_;
+    std::unique_ptr<OutputFn> output_;
+    std::unique_ptr<InputFn> input_;
+};
+
+} // namespace lc3
+
+#endif // LC3_API_HPP
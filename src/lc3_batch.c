@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "lc3.h"
+
+// Batch mode: run many independent jobs on a pool of worker threads, one
+// VM per worker. Jobs are dealt round-robin into per-worker Chase-Lev
+// deques; a worker pops from the bottom of its own deque and, once that is
+// empty, steals from the top of the others'.
+//
+// Manifest format, one job per line ('#' starts a comment):
+//   <budget> <stdin-file> <image> [<image> ...]
+// budget is an instruction limit (0 for none) and stdin-file is "-" when the
+// job gets no input. Paths cannot contain whitespace.
+
+#define DEQUE_EMPTY ((size_t)-1)
+#define DEQUE_ABORT ((size_t)-2)
+
+typedef struct
+{
+    int64_t top;
+    int64_t bottom;
+    int64_t mask;
+    size_t *items;
+} deque;
+
+typedef struct
+{
+    lc3_job *jobs;
+    deque *deques;
+    int workers;
+} batch;
+
+typedef struct
+{
+    batch *b;
+    int id;
+} worker_arg;
+
+static int deque_init(deque *q, size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size *= 2;
+    q->items = malloc(size * sizeof(*q->items));
+    q->top = 0;
+    q->bottom = 0;
+    q->mask = (int64_t)size - 1;
+    return q->items != NULL;
+}
+
+// Owner only
+static void deque_push(deque *q, size_t item)
+{
+    int64_t b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+    q->items[b & q->mask] = item;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+// Owner only
+static size_t deque_take(deque *q)
+{
+    int64_t b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+
+    if (t > b)
+    {
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        return DEQUE_EMPTY;
+    }
+
+    size_t item = q->items[b & q->mask];
+    if (t == b)
+    {
+        // Last item: race the thieves for it
+        if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            item = DEQUE_EMPTY;
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return item;
+}
+
+// Any thread
+static size_t deque_steal(deque *q)
+{
+    int64_t t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b)
+        return DEQUE_EMPTY;
+
+    size_t item = q->items[t & q->mask];
+    if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return DEQUE_ABORT;
+    return item;
+}
+
+// Own deque first, then sweep the others; no job ever spawns another, so a
+// sweep that finds every deque empty means the batch is drained
+static size_t next_job(batch *b, int id)
+{
+    size_t item = deque_take(&b->deques[id]);
+    if (item != DEQUE_EMPTY)
+        return item;
+
+    for (;;)
+    {
+        int contended = 0;
+        for (int i = 1; i < b->workers; ++i)
+        {
+            item = deque_steal(&b->deques[(id + i) % b->workers]);
+            if (item == DEQUE_ABORT)
+                contended = 1;
+            else if (item != DEQUE_EMPTY)
+                return item;
+        }
+        if (!contended)
+            return DEQUE_EMPTY;
+    }
+}
+
+static void run_job(lc3_vm *vm, lc3_job *job)
+{
+    lc3_reset(vm);
+    lc3_in_reset(vm);
+    lc3_out_init(vm, LC3_OUT_CAPTURE, LC3_FLUSH_BLOCK);
+    job->status = LC3_STATUS_ERROR;
+
+    for (int i = 0; i < job->image_count; ++i)
+    {
+        if (!lc3_load_image(vm, job->images[i]))
+        {
+            fprintf(stderr, "Error: Failed to load image: %s\n", job->images[i]);
+            return;
+        }
+    }
+
+    int fd = -1;
+    if (job->input)
+    {
+        fd = open(job->input, O_RDONLY);
+        if (fd < 0 || !lc3_in_start(vm, fd))
+        {
+            fprintf(stderr, "Error: Could not open input: %s\n", job->input);
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+    }
+    else
+    {
+        lc3_in_close(vm);
+    }
+
+    vm->instr_limit = job->budget ? job->budget : UINT64_MAX;
+    lc3_set_timeout(vm, job->timeout_ms);
+    lc3_run(vm);
+
+    job->status = vm->status;
+    job->instr_count = vm->instr_count;
+    job->output = lc3_out_take(vm, &job->output_len);
+
+    lc3_in_reset(vm);
+    if (fd >= 0)
+        close(fd);
+}
+
+static void *worker_main(void *arg)
+{
+    worker_arg *w = arg;
+    lc3_vm *vm = lc3_create();
+    if (!vm)
+        return NULL;
+
+    size_t item;
+    while ((item = next_job(w->b, w->id)) != DEQUE_EMPTY)
+    {
+        run_job(vm, &w->b->jobs[item]);
+    }
+
+    lc3_destroy(vm);
+    return NULL;
+}
+
+// Run every job, filling in its results. Returns 0 if the pool could not
+// be set up.
+int lc3_batch_run(lc3_job *jobs, size_t count, int workers)
+{
+    if (workers < 1)
+        workers = 1;
+    if ((size_t)workers > count)
+        workers = count ? (int)count : 1;
+
+    batch b = {jobs, calloc(workers, sizeof(deque)), workers};
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    worker_arg *args = calloc(workers, sizeof(worker_arg));
+    int ok = b.deques && threads && args;
+
+    for (int i = 0; ok && i < workers; ++i)
+    {
+        ok = deque_init(&b.deques[i], count / workers + 1);
+    }
+    for (size_t j = 0; ok && j < count; ++j)
+    {
+        jobs[j].status = LC3_STATUS_ERROR;
+        deque_push(&b.deques[j % workers], j);
+    }
+
+    // Thread creation publishes the filled deques to the workers
+    int started = 0;
+    for (; ok && started < workers; ++started)
+    {
+        args[started].b = &b;
+        args[started].id = started;
+        if (pthread_create(&threads[started], NULL, worker_main, &args[started]) != 0)
+            break;
+    }
+    if (ok && started == 0)
+        ok = 0;
+    for (int i = 0; i < started; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    // If some threads failed to start, the ones that did drained their deques
+    for (int i = 0; b.deques && i < workers; ++i)
+    {
+        free(b.deques[i].items);
+    }
+    free(b.deques);
+    free(threads);
+    free(args);
+    return ok;
+}
+
+// Parse a manifest. Returns 0 on success, -1 if it could not be read, or
+// the line number of a malformed entry.
+int lc3_batch_load(const char *path, lc3_job **out_jobs, size_t *count)
+{
+    FILE *file = fopen(path, "r");
+    *out_jobs = NULL;
+    *count = 0;
+    if (!file)
+        return -1;
+
+    lc3_job *jobs = NULL;
+    size_t n = 0, cap = 0;
+    int line_no = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    int ok = 1, result = 0;
+
+    while (ok && getline(&line, &line_cap, file) >= 0)
+    {
+        ++line_no;
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+
+        char *save = NULL;
+        char *budget = strtok_r(line, " \t\r\n", &save);
+        if (!budget)
+            continue;
+        char *input = strtok_r(NULL, " \t\r\n", &save);
+        char *image = strtok_r(NULL, " \t\r\n", &save);
+        char *end;
+        unsigned long long limit = strtoull(budget, &end, 10);
+        if (!input || !image || *end)
+        {
+            ok = 0;
+            result = line_no;
+            break;
+        }
+
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            lc3_job *grown = realloc(jobs, cap * sizeof(*jobs));
+            if (!grown)
+            {
+                ok = 0;
+                result = -1;
+                break;
+            }
+            jobs = grown;
+        }
+
+        lc3_job *job = &jobs[n++];
+        memset(job, 0, sizeof(*job));
+        job->budget = limit;
+        job->input = strcmp(input, "-") == 0 ? NULL : strdup(input);
+        for (; image; image = strtok_r(NULL, " \t\r\n", &save))
+        {
+            char **grown = realloc(job->images, (job->image_count + 1) * sizeof(char *));
+            if (!grown)
+            {
+                ok = 0;
+                result = -1;
+                break;
+            }
+            job->images = grown;
+            job->images[job->image_count++] = strdup(image);
+        }
+    }
+
+    free(line);
+    fclose(file);
+    if (!ok)
+    {
+        lc3_batch_free(jobs, n);
+        return result;
+    }
+    *out_jobs = jobs;
+    *count = n;
+    return 0;
+}
+
+void lc3_batch_free(lc3_job *jobs, size_t count)
+{
+    for (size_t j = 0; jobs && j < count; ++j)
+    {
+        for (int i = 0; i < jobs[j].image_count; ++i)
+        {
+            free(jobs[j].images[i]);
+        }
+        free(jobs[j].images);
+        free(jobs[j].input);
+        free(jobs[j].output);
+    }
+    free(jobs);
+}
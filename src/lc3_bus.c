@@ -0,0 +1,249 @@
+#include <string.h>
+#include "lc3.h"
+
+// Memory-mapped device bus for the I/O page (LC3_IO_BASE to 0xFFFF).
+//
+// Devices claim address ranges in the I/O page. bus.page flags the pages
+// holding any device, so mem_read and mem_write take a single branch for
+// ordinary memory; within a flagged page bus.map gives each address's
+// device. An address with no device, or a device without a handler for
+// that direction, reads and writes plain memory.
+//
+// Built-in devices:
+//   KBSR/KBDR  keyboard, polled through lc3_in_poll. A key stays latched
+//              until KBDR is read; KBSR bit 14 enables its interrupt
+//   DSR/DDR    display: DSR always reads ready, and characters written to
+//              DDR join the buffered output stream the traps write to
+//   TMR/TMI    timer: TMI is the period in units of LC3_TIMER_TICK
+//              instructions (0 stops it); reading TMR returns bit 15 set
+//              once a period has passed since the last time it did
+//   PSR        processor status, see lc3_interrupt.c
+//   MCR        machine control: clearing bit 15 halts the machine
+
+// Latch a key into KBDR unless one is already waiting. Returns 1 if KBSR
+// now reads ready.
+int lc3_keyboard_ready(lc3_vm *vm)
+{
+    if (!(vm->memory[MR_KBSR] & KBSR_READY))
+    {
+        int c = lc3_in_poll(vm);
+        if (c < 0)
+        {
+            return 0;
+        }
+        vm->memory[MR_KBSR] |= KBSR_READY;
+        vm->memory[MR_KBDR] = (uint16_t)c;
+        lc3_mark_dirty(vm, MR_KBSR);
+    }
+    return 1;
+}
+
+// GETC and IN take a latched key before reading more input
+int lc3_keyboard_getc(lc3_vm *vm)
+{
+    if (vm->memory[MR_KBSR] & KBSR_READY)
+    {
+        vm->memory[MR_KBSR] &= ~KBSR_READY;
+        lc3_mark_dirty(vm, MR_KBSR);
+        return vm->memory[MR_KBDR];
+    }
+    return lc3_in_getc(vm);
+}
+
+static uint16_t keyboard_read(lc3_vm *vm, uint16_t address, void *ctx)
+{
+    (void)ctx;
+    if (address == MR_KBSR)
+    {
+        // A polling guest has usually just printed a prompt
+        if (vm->out.head != vm->out.tail)
+        {
+            lc3_out_flush(vm);
+        }
+        LC3_PROF_INC(vm, kbsr_polls);
+        lc3_keyboard_ready(vm);
+    }
+    else if (address == MR_KBDR)
+    {
+        vm->memory[MR_KBSR] &= ~KBSR_READY;
+        lc3_mark_dirty(vm, MR_KBSR);
+    }
+    return vm->memory[address];
+}
+
+// Only the interrupt enable bit of KBSR is writable
+static void keyboard_write(lc3_vm *vm, uint16_t address, uint16_t value, void *ctx)
+{
+    (void)ctx;
+    if (address == MR_KBSR)
+    {
+        vm->memory[MR_KBSR] = (vm->memory[MR_KBSR] & KBSR_READY) | (value & KBSR_IE);
+    }
+}
+
+static uint16_t display_read(lc3_vm *vm, uint16_t address, void *ctx)
+{
+    (void)ctx;
+    return address == MR_DSR ? 1 << 15 : vm->memory[address];
+}
+
+static void display_write(lc3_vm *vm, uint16_t address, uint16_t value, void *ctx)
+{
+    (void)ctx;
+    // DSR is read-only
+    if (address == MR_DDR)
+    {
+        vm->memory[MR_DDR] = value;
+        lc3_out_putc(vm, (char)value);
+        lc3_out_sync(vm);
+    }
+}
+
+static uint16_t timer_read(lc3_vm *vm, uint16_t address, void *ctx)
+{
+    (void)ctx;
+    lc3_bus *bus = &vm->bus;
+    if (address == MR_TMR)
+    {
+        uint64_t period = (uint64_t)vm->memory[MR_TMI] * LC3_TIMER_TICK;
+        int fired = period && vm->instr_count >= bus->timer_next;
+        if (fired)
+            bus->timer_next = vm->instr_count + period;
+        return fired ? 1 << 15 : 0;
+    }
+    return vm->memory[address];
+}
+
+static void timer_write(lc3_vm *vm, uint16_t address, uint16_t value, void *ctx)
+{
+    (void)ctx;
+    vm->memory[address] = value;
+    if (address == MR_TMI)
+        vm->bus.timer_next = vm->instr_count + (uint64_t)value * LC3_TIMER_TICK;
+}
+
+static void timer_reset(lc3_vm *vm, void *ctx)
+{
+    (void)ctx;
+    vm->memory[MR_TMI] = 0;
+    vm->bus.timer_next = 0;
+}
+
+static uint16_t psr_read(lc3_vm *vm, uint16_t address, void *ctx)
+{
+    (void)address;
+    (void)ctx;
+    return lc3_psr(vm);
+}
+
+static void psr_write(lc3_vm *vm, uint16_t address, uint16_t value, void *ctx)
+{
+    (void)address;
+    (void)ctx;
+    lc3_set_psr(vm, value);
+}
+
+static void mcr_write(lc3_vm *vm, uint16_t address, uint16_t value, void *ctx)
+{
+    (void)ctx;
+    vm->memory[address] = value;
+    if (!(value & 0x8000))
+    {
+        lc3_out_flush(vm);
+        vm->status = LC3_STATUS_HALTED;
+        vm->running = 0;
+    }
+}
+
+static void mcr_reset(lc3_vm *vm, void *ctx)
+{
+    (void)ctx;
+    vm->memory[MR_MCR] = 0x8000;
+}
+
+static const lc3_device keyboard_device = {"keyboard", keyboard_read, keyboard_write, NULL, NULL};
+static const lc3_device display_device = {"display", display_read, display_write, NULL, NULL};
+static const lc3_device timer_device = {"timer", timer_read, timer_write, timer_reset, NULL};
+static const lc3_device psr_device = {"psr", psr_read, psr_write, NULL, NULL};
+static const lc3_device mcr_device = {"mcr", NULL, mcr_write, mcr_reset, NULL};
+
+// Attach the built-in devices; called once from lc3_create
+void lc3_bus_init(lc3_vm *vm)
+{
+    memset(&vm->bus, 0, sizeof(vm->bus));
+    lc3_bus_attach(vm, MR_KBSR, MR_KBDR, &keyboard_device);
+    lc3_bus_attach(vm, MR_DSR, MR_DDR, &display_device);
+    lc3_bus_attach(vm, MR_TMR, MR_TMI, &timer_device);
+    lc3_bus_attach(vm, MR_PSR, MR_PSR, &psr_device);
+    lc3_bus_attach(vm, MR_MCR, MR_MCR, &mcr_device);
+}
+
+// Map dev over first..last. Returns 0 if the range leaves the I/O page,
+// overlaps another device, or the bus is full.
+int lc3_bus_attach(lc3_vm *vm, uint16_t first, uint16_t last, const lc3_device *dev)
+{
+    lc3_bus *bus = &vm->bus;
+    if (first < LC3_IO_BASE || last < first || bus->count == LC3_MAX_DEVICES)
+    {
+        return 0;
+    }
+    for (uint32_t a = first; a <= last; ++a)
+    {
+        if (bus->map[a - LC3_IO_BASE])
+        {
+            return 0;
+        }
+    }
+
+    bus->devices[bus->count++] = *dev;
+    for (uint32_t a = first; a <= last; ++a)
+    {
+        bus->map[a - LC3_IO_BASE] = (uint8_t)bus->count;
+        bus->page[a >> LC3_PAGE_SHIFT] = 1;
+    }
+    if (dev->reset)
+    {
+        dev->reset(vm, dev->ctx);
+    }
+    return 1;
+}
+
+// Put every device back in its power-on state; memory has just been cleared
+void lc3_bus_reset(lc3_vm *vm)
+{
+    lc3_bus *bus = &vm->bus;
+    for (int i = 0; i < bus->count; ++i)
+    {
+        if (bus->devices[i].reset)
+        {
+            bus->devices[i].reset(vm, bus->devices[i].ctx);
+        }
+    }
+}
+
+// mem_read for an address in a device page
+uint16_t lc3_bus_read(lc3_vm *vm, uint16_t address)
+{
+    uint8_t id = vm->bus.map[address - LC3_IO_BASE];
+    const lc3_device *dev = id ? &vm->bus.devices[id - 1] : NULL;
+    if (dev && dev->read)
+    {
+        return dev->read(vm, address, dev->ctx);
+    }
+    return vm->memory[address];
+}
+
+// mem_write for an address in a device page. Returns 0 if the address is
+// plain memory after all.
+int lc3_bus_write(lc3_vm *vm, uint16_t address, uint16_t value)
+{
+    uint8_t id = vm->bus.map[address - LC3_IO_BASE];
+    const lc3_device *dev = id ? &vm->bus.devices[id - 1] : NULL;
+    if (dev && dev->write)
+    {
+        dev->write(vm, address, value, dev->ctx);
+        lc3_mark_dirty(vm, address);
+        return 1;
+    }
+    return 0;
+}
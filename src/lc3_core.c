@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/time.h>
@@ -10,78 +11,74 @@
 #include <sys/mman.h>
 #include "lc3.h"
 
-uint16_t memory[MEMORY_MAX];
-uint16_t reg[R_COUNT];
 static struct termios original_tio;
-static volatile sig_atomic_t running = 1;
+// Signals noted for the engines, checked at every control transfer
+enum
+{
+    PENDING_INTERRUPT = 1 << 0, // SIGINT
+    PENDING_SAMPLE = 1 << 1     // SIGPROF from lc3_sample_timer
+};
+
+static volatile sig_atomic_t pending = 0;
 
-uint16_t sign_extend(uint16_t x, int bit_count)
+// Pick a result value whose flags match R_COND
+void lc3_cond_load(lc3_vm *vm)
 {
-    if ((x >> (bit_count - 1)) & 1)
-    {
-        x |= (0xFFFF << bit_count);
-    }
-    return x;
+    uint16_t cond = vm->reg[R_COND];
+    vm->cc = (cond & FL_NEG) ? 0x8000 : (cond & FL_ZRO) ? 0 : 1;
 }
 
-uint16_t swap16(uint16_t x)
+void lc3_cond_save(lc3_vm *vm)
 {
-    return (x << 8) | (x >> 8);
+    vm->reg[R_COND] = cond_flags(vm->cc);
 }
 
-void update_flags(uint16_t r)
+// SIGINT is process-wide; every running VM observes it
+void handle_interrupt(int signal)
 {
-    if (reg[r] == 0)
-    {
-        reg[R_COND] = FL_ZRO;
-    }
-    else if (reg[r] >> 15)
-    {
-        reg[R_COND] = FL_NEG;
-    }
-    else
-    {
-        reg[R_COND] = FL_POS;
-    }
+    (void)signal;
+    __atomic_or_fetch(&pending, PENDING_INTERRUPT, __ATOMIC_RELAXED);
 }
 
-uint16_t check_key()
+static void handle_sample(int signal)
 {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
+    (void)signal;
+    __atomic_or_fetch(&pending, PENDING_SAMPLE, __ATOMIC_RELAXED);
+}
 
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
+int lc3_interrupted(void)
+{
+    return pending & PENDING_INTERRUPT;
 }
 
-void mem_write(uint16_t address, uint16_t val)
+int lc3_events_pending(void)
 {
-    memory[address] = val;
+    return pending;
 }
 
-uint16_t mem_read(uint16_t address)
+int lc3_take_sample_request(void)
 {
-    if (address == MR_KBSR)
-    {
-        if (check_key())
-        {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
-        }
-        else
-        {
-            memory[MR_KBSR] = 0;
-        }
-    }
-    return memory[address];
+    return (__atomic_fetch_and(&pending, ~PENDING_SAMPLE, __ATOMIC_RELAXED) & PENDING_SAMPLE) != 0;
 }
 
-void handle_interrupt(int signal)
+// Request a sample hz times per second of CPU time; 0 stops the timer
+int lc3_sample_timer(int hz)
 {
-    running = 0;
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    if (hz > 0)
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_sample;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGPROF, &sa, NULL) != 0)
+            return 0;
+        timer.it_interval.tv_usec = hz >= 1000000 ? 1 : 1000000 / hz;
+        timer.it_value = timer.it_interval;
+    }
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
 }
 
 void disable_input_buffering()
@@ -108,27 +105,72 @@ void lc3_cleanup()
     restore_input_buffering();
 }
 
-int lc3_load_image(const char *image_path)
+lc3_vm *lc3_create(void)
 {
-    FILE *file = fopen(image_path, "rb");
-    if (!file)
+    // Page-aligned so lc3_fork can map memory over the start of the struct
+    lc3_vm *vm = mmap(NULL, sizeof(*vm), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (vm == MAP_FAILED)
     {
-        return 0;
+        return NULL;
     }
+    vm->decoded = NULL;
+    vm->jit = NULL;
+    vm->cow = NULL;
+    vm->sampler = NULL;
+    vm->tracer = NULL;
+    vm->input_log = NULL;
+    vm->os = NULL;
+    lc3_out_init(vm, STDOUT_FILENO, LC3_FLUSH_LINE);
+    lc3_in_init(vm);
+    lc3_bus_init(vm);
+    lc3_reset(vm);
+    return vm;
+}
 
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
-
-    uint16_t max_read = MEMORY_MAX - origin;
-    uint16_t *p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+void lc3_destroy(lc3_vm *vm)
+{
+    lc3_in_stop(vm);
+    lc3_invalidate_decoded(vm);
+#ifdef LC3_JIT
+    lc3_jit_destroy(vm->jit);
+#endif
+    lc3_fork_release(vm);
+    lc3_sampler_disable(vm);
+    lc3_trace_stop(vm);
+    lc3_input_log_close(vm);
+    lc3_os_disable(vm);
+    free(vm->out.capture);
+    munmap(vm, sizeof(*vm));
+}
 
-    for (size_t i = 0; i < read; ++i)
+void lc3_reset(lc3_vm *vm)
+{
+    // Fresh zero pages, which also drops any fork image mapping
+    lc3_fork_release(vm);
+    if (mmap(vm->memory, sizeof(vm->memory), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
     {
-        p[i] = swap16(p[i]);
+        memset(vm->memory, 0, sizeof(vm->memory));
     }
-
-    fclose(file);
-    return 1;
+    memset(vm->reg, 0, sizeof(vm->reg));
+    vm->reg[R_PC] = PC_START;
+    vm->reg[R_COND] = FL_ZRO;
+    vm->cc = 0;
+    vm->psr = PSR_USER; // as a user program started by the OS, priority 0
+    vm->saved_ssp = LC3_SSP_START;
+    vm->saved_usp = 0;
+    vm->instr_count = 0;
+    vm->instr_limit = UINT64_MAX;
+    vm->deadline_ns = 0;
+#ifdef LC3_PROFILE
+    memset(&vm->prof, 0, sizeof(vm->prof));
+#endif
+    vm->status = LC3_STATUS_RUNNING;
+    vm->out.head = vm->out.tail = 0;
+    vm->out.newline = 0;
+    vm->running = 0;
+    vm->snapshot_id = 0;
+    memset(vm->dirty, LC3_DIRTY_ALL, sizeof(vm->dirty));
+    lc3_bus_reset(vm);
+    lc3_invalidate_decoded(vm);
 }
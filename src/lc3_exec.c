@@ -1,673 +1,927 @@
-#include <stdlib.h>
-#include <stdint.h>
 #include <stdio.h>
-#include <string.h>
-#include <sys/time.h>
-#include <unistd.h>
-#include <sys/termios.h>
-#include <signal.h>
-#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "lc3.h"
 
-#define MEMORY_MAX (1 << 16)
-#define MEMORY_SIZE MEMORY_MAX
+#define PRINT_ERROR(...) fprintf(stderr, "Error: " __VA_ARGS__)
 
-// Memory
-static uint16_t memory[MEMORY_SIZE];
+// With a deadline set, the clock is read once per this many instructions
+#define LC3_DEADLINE_CHECK (1 << 16)
 
-// Registers
-enum
+void exec_trap(lc3_vm *vm, uint16_t instr)
 {
-    R_R0 = 0,
-    R_R1,
-    R_R2,
-    R_R3,
-    R_R4,
-    R_R5,
-    R_R6,
-    R_R7,
-    R_PC,
-    R_COND,
-    R_COUNT
-};
+#ifdef LC3_PROFILE
+    uint64_t start = lc3_profile_ticks();
+    vm->prof.trap[instr & 0xFF]++;
+#endif
+    vm->reg[R_R7] = vm->reg[R_PC];
 
-static uint16_t reg[R_COUNT];
+    // With a guest OS, routines identical to the built-in OS's still run
+    // natively
+    switch (vm->os ? lc3_os_native(vm, instr & 0xFF) : instr & 0xFF)
+    {
+    case LC3_OS_GUEST:
+        vm->reg[R_PC] = mem_read(vm, instr & 0xFF);
+        if (vm->sampler)
+        {
+            lc3_sampler_call(vm, vm->reg[R_PC]);
+        }
+        break;
+    case TRAP_GETC:
+        trap_getc(vm);
+        break;
+    case TRAP_OUT:
+        trap_out(vm);
+        break;
+    case TRAP_PUTS:
+        trap_puts(vm);
+        break;
+    case TRAP_IN:
+        trap_in(vm);
+        break;
+    case TRAP_PUTSP:
+        trap_putsp(vm);
+        break;
+    case TRAP_HALT:
+        trap_halt(vm);
+        break;
+    case LC3_OS_BAD_TRAP:
+        trap_bad(vm);
+        break;
+    default:
+        lc3_out_flush(vm);
+        PRINT_ERROR("Unknown trap code: %X\n", instr & 0xFF);
+        vm->status = LC3_STATUS_BAD_TRAP;
+        vm->running = 0;
+        break;
+    }
+#ifdef LC3_PROFILE
+    vm->prof.trap_ticks[instr & 0xFF] += lc3_profile_ticks() - start;
+#endif
+}
 
-// Opcodes
-enum
+// Helper function to dump memory contents (for debugging)
+void memory_dump(lc3_vm *vm, uint16_t start, uint16_t count)
 {
-    OP_BR = 0,
-    OP_ADD,
-    OP_LD,
-    OP_ST,
-    OP_JSR,
-    OP_AND,
-    OP_LDR,
-    OP_STR,
-    OP_RTI,
-    OP_NOT,
-    OP_LDI,
-    OP_STI,
-    OP_JMP,
-    OP_RES,
-    OP_LEA,
-    OP_TRAP
-};
+    uint16_t words[8];
+    for (uint16_t i = 0; i < count; i++)
+    {
+        if (i % 8 == 0)
+        {
+            printf("\n%04X: ", (uint16_t)(start + i));
+            lc3_mem_read_block(vm, (uint16_t)(start + i), words, 8);
+        }
+        printf("%04X ", words[i % 8]);
+    }
+    printf("\n");
+}
 
-// Condition Flags
-enum
+// Helper function to dump register contents (for debugging)
+void register_dump(lc3_vm *vm)
 {
-    FL_POS = 1 << 0,
-    FL_ZRO = 1 << 1,
-    FL_NEG = 1 << 2,
-};
+    for (int i = 0; i < R_COUNT; i++)
+    {
+        printf("R%d: %04X ", i, vm->reg[i]);
+        if (i % 3 == 2)
+            printf("\n");
+    }
+    printf("\n");
+}
 
-// Trap Codes
-enum
+// Record why a run ended if no instruction already did
+static void finish_status(lc3_vm *vm)
 {
-    TRAP_GETC = 0x20,
-    TRAP_OUT = 0x21,
-    TRAP_PUTS = 0x22,
-    TRAP_IN = 0x23,
-    TRAP_PUTSP = 0x24,
-    TRAP_HALT = 0x25
-};
+    if (vm->status == LC3_STATUS_RUNNING)
+    {
+        vm->status = lc3_interrupted() ? LC3_STATUS_INTERRUPTED : LC3_STATUS_BUDGET;
+    }
+}
 
-// Memory Mapped Registers
-enum
+const char *lc3_status_name(int status)
 {
-    MR_KBSR = 0xFE00,
-    MR_KBDR = 0xFE02
-};
+    switch (status)
+    {
+    case LC3_STATUS_RUNNING:
+        return "running";
+    case LC3_STATUS_HALTED:
+        return "halted";
+    case LC3_STATUS_BUDGET:
+        return "budget";
+    case LC3_STATUS_PAUSED:
+        return "paused";
+    case LC3_STATUS_DEADLINE:
+        return "deadline";
+    case LC3_STATUS_INTERRUPTED:
+        return "interrupted";
+    case LC3_STATUS_BAD_OPCODE:
+        return "bad-opcode";
+    case LC3_STATUS_BAD_TRAP:
+        return "bad-trap";
+    default:
+        return "error";
+    }
+}
 
-// Function prototypes
-static void update_flags(uint16_t r);
-static uint16_t sign_extend(uint16_t x, int bit_count);
-static uint16_t swap16(uint16_t x);
-static uint16_t check_key(void);
-static void mem_write(uint16_t address, uint16_t val);
-static uint16_t mem_read(uint16_t address);
-static int read_image(const char *image_path);
-static void handle_interrupt(int signal);
-static void disable_input_buffering(void);
-static void restore_input_buffering(void);
-
-// Improved error handling
-#define PRINT_ERROR(...) fprintf(stderr, "Error: " __VA_ARGS__)
-#define EXIT_WITH_ERROR(...)      \
-    do                            \
-    {                             \
-        PRINT_ERROR(__VA_ARGS__); \
-        exit(1);                  \
-    } while (0)
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
 
-// Instruction execution functions
-static void exec_add(uint16_t instr);
-static void exec_and(uint16_t instr);
-static void exec_br(uint16_t instr);
-static void exec_jmp(uint16_t instr);
-static void exec_jsr(uint16_t instr);
-static void exec_ld(uint16_t instr);
-static void exec_ldi(uint16_t instr);
-static void exec_ldr(uint16_t instr);
-static void exec_lea(uint16_t instr);
-static void exec_not(uint16_t instr);
-static void exec_st(uint16_t instr);
-static void exec_sti(uint16_t instr);
-static void exec_str(uint16_t instr);
-static void exec_trap(uint16_t instr);
-
-// Trap routines
-static void trap_getc(void);
-static void trap_out(void);
-static void trap_puts(void);
-static void trap_in(void);
-static void trap_putsp(void);
-static void trap_halt(void);
-
-// Global variables for input buffering
-static struct termios original_tio;
-static volatile sig_atomic_t running = 1;
-
-int main(int argc, char *argv[])
+void lc3_set_timeout(lc3_vm *vm, uint64_t ms)
 {
-    if (argc < 2)
+    vm->deadline_ns = ms ? monotonic_ns() + ms * 1000000u : 0;
+}
+
+// Called once count reaches *limit or a signal is pending: take a profiler
+// sample if one is due, flush block-buffered output that has aged, stop for
+// the budget or the deadline, or move *limit to the next point where one of
+// them needs checking
+static int next_slice(lc3_vm *vm, uint64_t count, uint64_t *limit)
+{
+    int sample_requested = lc3_take_sample_request();
+    uint64_t next = vm->instr_limit;
+
+    if (vm->sampler)
     {
-        PRINT_ERROR("Usage: %s <image-file1> ...\n", argv[0]);
-        exit(2);
+        uint64_t due = lc3_sample_tick(vm, count, sample_requested);
+        if (due < next)
+            next = due;
     }
-
-    for (int j = 1; j < argc; ++j)
+    if (count >= vm->instr_limit)
     {
-        if (!read_image(argv[j]))
+        return 0;
+    }
+    if (vm->deadline_ns)
+    {
+        if (monotonic_ns() >= vm->deadline_ns)
         {
-            EXIT_WITH_ERROR("Failed to load image: %s\n", argv[j]);
+            vm->status = LC3_STATUS_DEADLINE;
+            return 0;
         }
+        if (next - count > LC3_DEADLINE_CHECK)
+            next = count + LC3_DEADLINE_CHECK;
+    }
+    if (vm->out.head != vm->out.tail && vm->out.policy == LC3_FLUSH_BLOCK)
+    {
+        // Otherwise a guest that prints and then computes keeps its output
+        // until it prints again
+        lc3_out_sync(vm);
+        if (vm->out.head != vm->out.tail && next - count > LC3_DEADLINE_CHECK)
+            next = count + LC3_DEADLINE_CHECK;
     }
+    *limit = next;
+    return 1;
+}
 
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
+// Reference execution loop: switch on the opcode and call exec_*
+void lc3_run_switch(lc3_vm *vm)
+{
+    uint64_t limit = 0;
 
-    // Set the PC to starting position
-    // 0x3000 is the default
-    enum
+    vm->running = 1;
+    vm->status = LC3_STATUS_RUNNING;
+    lc3_cond_load(vm);
+    if (vm->tracer)
     {
-        PC_START = 0x3000
-    };
-    reg[R_PC] = PC_START;
+        lc3_trace_sync(vm);
+    }
 
-    while (running)
+    while (vm->running)
     {
-        uint16_t instr = mem_read(reg[R_PC]++);
+        if ((vm->instr_count >= limit || lc3_events_pending()) &&
+            (lc3_interrupted() || !next_slice(vm, vm->instr_count, &limit)))
+            break;
+
+        uint16_t pc = vm->reg[R_PC]++;
+        uint16_t instr = mem_read(vm, pc);
+        vm->instr_count++;
         uint16_t op = instr >> 12;
+        int transfer = 0; // interrupts are taken after these, as in lc3_run_threaded
+        LC3_PROF_INC(vm, op[op]);
 
         switch (op)
         {
         case OP_ADD:
-            exec_add(instr);
+            exec_add(vm, instr);
             break;
         case OP_AND:
-            exec_and(instr);
+            exec_and(vm, instr);
             break;
         case OP_BR:
-            exec_br(instr);
+            // A branch not taken is no transfer, except the no-condition NOP
+            transfer = !(instr & 0x0E00) || (((instr >> 9) & 0x7) & cond_flags(vm->cc));
+            exec_br(vm, instr);
             break;
         case OP_JMP:
-            exec_jmp(instr);
+            exec_jmp(vm, instr);
+            transfer = 1;
             break;
         case OP_JSR:
-            exec_jsr(instr);
+            exec_jsr(vm, instr);
+            transfer = 1;
             break;
         case OP_LD:
-            exec_ld(instr);
+            exec_ld(vm, instr);
             break;
         case OP_LDI:
-            exec_ldi(instr);
+            exec_ldi(vm, instr);
             break;
         case OP_LDR:
-            exec_ldr(instr);
+            exec_ldr(vm, instr);
             break;
         case OP_LEA:
-            exec_lea(instr);
+            exec_lea(vm, instr);
             break;
         case OP_NOT:
-            exec_not(instr);
+            exec_not(vm, instr);
             break;
         case OP_ST:
-            exec_st(instr);
+            exec_st(vm, instr);
             break;
         case OP_STI:
-            exec_sti(instr);
+            exec_sti(vm, instr);
             break;
         case OP_STR:
-            exec_str(instr);
+            exec_str(vm, instr);
             break;
         case OP_TRAP:
-            exec_trap(instr);
+            exec_trap(vm, instr);
+            transfer = 1;
             break;
-        case OP_RES:
         case OP_RTI:
+            exec_rti(vm, instr);
+            transfer = 1;
+            break;
+        case OP_RES:
         default:
-            PRINT_ERROR("BAD OPCODE: %d\n", op);
-            running = 0;
+            lc3_exception(vm, LC3_EXC_ILLEGAL);
+            transfer = 1;
             break;
         }
-    }
-
-    restore_input_buffering();
-    return 0;
-}
-
-static void update_flags(uint16_t r)
-{
-    if (reg[r] == 0)
-    {
-        reg[R_COND] = FL_ZRO;
-    }
-    else if (reg[r] >> 15)
-    {
-        reg[R_COND] = FL_NEG;
-    }
-    else
-    {
-        reg[R_COND] = FL_POS;
-    }
-}
-
-static uint16_t sign_extend(uint16_t x, int bit_count)
-{
-    if ((x >> (bit_count - 1)) & 1)
-    {
-        x |= (0xFFFF << bit_count);
-    }
-    return x;
-}
 
-static uint16_t swap16(uint16_t x)
-{
-    return (x << 8) | (x >> 8);
-}
-
-static uint16_t check_key()
-{
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
-}
-
-static void mem_write(uint16_t address, uint16_t val)
-{
-    memory[address] = val;
-}
-
-static uint16_t mem_read(uint16_t address)
-{
-    if (address == MR_KBSR)
-    {
-        if (check_key())
+        if (vm->tracer)
         {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
+            lc3_trace_step(vm, pc, instr);
         }
-        else
+        if (transfer && vm->running && (vm->memory[MR_KBSR] & KBSR_IE) &&
+            lc3_deliver_interrupts(vm) && vm->tracer)
         {
-            memory[MR_KBSR] = 0;
+            lc3_trace_sync(vm);
         }
     }
-    return memory[address];
-}
-
-static int read_image(const char *image_path)
-{
-    FILE *file = fopen(image_path, "rb");
-    if (!file)
-    {
-        PRINT_ERROR("Could not open file: %s\n", image_path);
-        return 0;
-    }
-
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
-
-    uint16_t max_read = MEMORY_MAX - origin;
-    uint16_t *p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
-
-    for (size_t i = 0; i < read; ++i)
-    {
-        p[i] = swap16(p[i]);
-    }
-
-    fclose(file);
-    return 1;
-}
-
-static void handle_interrupt(int signal)
-{
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
-}
-
-static void disable_input_buffering()
-{
-    tcgetattr(STDIN_FILENO, &original_tio);
-    struct termios new_tio = original_tio;
-    new_tio.c_lflag &= ~ICANON & ~ECHO;
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
-}
-
-static void restore_input_buffering()
-{
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
-}
-
-// Instruction execution functions
-static void exec_add(uint16_t instr)
-{
-    uint16_t r0 = (instr >> 9) & 0x7;
-    uint16_t r1 = (instr >> 6) & 0x7;
-    uint16_t imm_flag = (instr >> 5) & 0x1;
-
-    if (imm_flag)
-    {
-        uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-        reg[r0] = reg[r1] + imm5;
-    }
-    else
-    {
-        uint16_t r2 = instr & 0x7;
-        reg[r0] = reg[r1] + reg[r2];
-    }
 
-    update_flags(r0);
+    finish_status(vm);
+    lc3_cond_save(vm);
+    lc3_out_flush(vm);
+    vm->running = 0;
 }
 
-static void exec_and(uint16_t instr)
-{
-    uint16_t r0 = (instr >> 9) & 0x7;
-    uint16_t r1 = (instr >> 6) & 0x7;
-    uint16_t imm_flag = (instr >> 5) & 0x1;
+#ifdef LC3_HAVE_THREADED_DISPATCH
 
-    if (imm_flag)
-    {
-        uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-        reg[r0] = reg[r1] & imm5;
-    }
-    else
-    {
-        uint16_t r2 = instr & 0x7;
-        reg[r0] = reg[r1] & reg[r2];
-    }
-
-    update_flags(r0);
-}
-
-static void exec_br(uint16_t instr)
-{
-    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    uint16_t cond_flag = (instr >> 9) & 0x7;
-    if (cond_flag & reg[R_COND])
-    {
-        reg[R_PC] += pc_offset;
-    }
-}
-
-static void exec_jmp(uint16_t instr)
+// Handler kinds a word can decode to; register and immediate forms are split
+enum
 {
-    uint16_t r1 = (instr >> 6) & 0x7;
-    reg[R_PC] = reg[r1];
-}
+    H_NOP = 0, // BR handlers are ordered by their nzp mask
+    H_BRP,
+    H_BRZ,
+    H_BRZP,
+    H_BRN,
+    H_BRNP,
+    H_BRNZ,
+    H_BRNZP,
+    H_ADD_REG,
+    H_ADD_IMM,
+    H_AND_REG,
+    H_AND_IMM,
+    H_NOT,
+    H_LD,
+    H_LDI,
+    H_LDR,
+    H_LEA,
+    H_ST,
+    H_STI,
+    H_STR,
+    H_JMP,
+    H_JSR,
+    H_JSRR,
+    H_TRAP,
+    H_RTI,
+    H_BAD,
+    H_LOAD_CONST, // fused pairs, see fuse()
+    H_ADD_BRP,    // ADD+BR handlers are ordered by the BR's nzp mask
+    H_ADD_BRZ,
+    H_ADD_BRZP,
+    H_ADD_BRN,
+    H_ADD_BRNP,
+    H_ADD_BRNZ,
+    H_ADD_BRNZP,
+    H_ADD_JMP,
+    H_COPY,
+    H_COUNT
+};
 
-static void exec_jsr(uint16_t instr)
-{
-    uint16_t long_flag = (instr >> 11) & 1;
-    reg[R_R7] = reg[R_PC];
-    if (long_flag)
+// Superinstructions: common pairs of words that run as a single handler.
+// Returns the fused kind for the word decoded into d, given the word after
+// it, or kind unchanged. The second word keeps its own entry, so a jump
+// that lands on it runs it alone; mem_write drops both entries when it
+// changes. Fused entries reuse sr2 and instr for the second word's
+// operands. Profiling builds count every instruction, so they never fuse.
+static int fuse(lc3_insn *d, int kind, uint16_t next_instr, uint16_t next)
+{
+#ifdef LC3_PROFILE
+    (void)d;
+    (void)next_instr;
+    (void)next;
+    return kind;
+#else
+    uint16_t op = next_instr >> 12;
+    uint8_t dr = (next_instr >> 9) & 0x7;
+    uint8_t sr1 = (next_instr >> 6) & 0x7;
+
+    switch (kind)
     {
-        uint16_t long_pc_offset = sign_extend(instr & 0x7FF, 11);
-        reg[R_PC] += long_pc_offset;
-    }
-    else
-    {
-        uint16_t r1 = (instr >> 6) & 0x7;
-        reg[R_PC] = reg[r1];
+    case H_AND_IMM:
+        // AND Rx,Ry,#0 ; ADD Rx,Rx,#imm loads a constant
+        if (d->imm == 0 && op == OP_ADD && (next_instr & 0x20) && dr == d->dr && sr1 == d->dr)
+        {
+            d->imm = sign_extend(next_instr & 0x1F, 5);
+            return H_LOAD_CONST;
+        }
+        break;
+    case H_ADD_IMM:
+        // Loop counters (ADD ; BRp), and stack pops before a return
+        if (op == OP_BR && dr)
+        {
+            d->instr = next + 1 + sign_extend(next_instr & 0x1FF, 9);
+            return H_ADD_BRP + dr - 1;
+        }
+        if (op == OP_JMP)
+        {
+            d->sr2 = sr1;
+            return H_ADD_JMP;
+        }
+        break;
+    case H_LDR:
+        // LDR Rx,... ; STR Rx,... copies a word
+        if (op == OP_STR && dr == d->dr)
+        {
+            d->sr2 = sr1;
+            d->instr = sign_extend(next_instr & 0x3F, 6);
+            return H_COPY;
+        }
+        break;
     }
+    return kind;
+#endif
 }
 
-static void exec_ld(uint16_t instr)
-{
-    uint16_t r0 = (instr >> 9) & 0x7;
-    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    reg[r0] = mem_read(reg[R_PC] + pc_offset);
-    update_flags(r0);
-}
-
-static void exec_ldi(uint16_t instr)
-{
-    uint16_t r0 = (instr >> 9) & 0x7;
-    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    reg[r0] = mem_read(mem_read(reg[R_PC] + pc_offset));
-    update_flags(r0);
-}
-
-static void exec_ldr(uint16_t instr)
-{
-    uint16_t r0 = (instr >> 9) & 0x7;
-    uint16_t r1 = (instr >> 6) & 0x7;
-    uint16_t offset = sign_extend(instr & 0x3F, 6);
-    reg[r0] = mem_read(reg[r1] + offset);
-    update_flags(r0);
-}
-
-static void exec_lea(uint16_t instr)
-{
-    uint16_t r0 = (instr >> 9) & 0x7;
-    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    reg[r0] = reg[R_PC] + pc_offset;
-    update_flags(r0);
-}
-
-static void exec_not(uint16_t instr)
-{
-    uint16_t r0 = (instr >> 9) & 0x7;
-    uint16_t r1 = (instr >> 6) & 0x7;
-    reg[r0] = ~reg[r1];
-    update_flags(r0);
-}
-
-static void exec_st(uint16_t instr)
-{
-    uint16_t r0 = (instr >> 9) & 0x7;
-    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    mem_write(reg[R_PC] + pc_offset, reg[r0]);
-}
-
-static void exec_sti(uint16_t instr)
+// Decode the word at pc into its cache slot. Words in the I/O page are
+// decoded into scratch every time so that fetch side effects still happen.
+static const lc3_insn *decode(lc3_vm *vm, uint16_t pc, void *const *handlers, lc3_insn *scratch)
 {
-    uint16_t r0 = (instr >> 9) & 0x7;
-    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    mem_write(mem_read(reg[R_PC] + pc_offset), reg[r0]);
-}
+    lc3_insn *d = pc >= LC3_IO_BASE ? scratch : &vm->decoded[pc];
+    uint16_t instr = mem_read(vm, pc);
+    uint16_t next = pc + 1;
+    int kind;
 
-static void exec_str(uint16_t instr)
-{
-    uint16_t r0 = (instr >> 9) & 0x7;
-    uint16_t r1 = (instr >> 6) & 0x7;
-    uint16_t offset = sign_extend(instr & 0x3F, 6);
-    mem_write(reg[r1] + offset, reg[r0]);
-}
+    d->instr = instr;
+    d->dr = (instr >> 9) & 0x7;
+    d->sr1 = (instr >> 6) & 0x7;
+    d->sr2 = instr & 0x7;
+    d->imm = 0;
 
-static void exec_trap(uint16_t instr)
-{
-    switch (instr & 0xFF)
+    switch (instr >> 12)
     {
-    case TRAP_GETC:
-        trap_getc();
+    case OP_BR:
+        // Each nzp mask gets its own handler, indexed by the mask itself
+        kind = H_NOP + d->dr;
+        d->imm = next + sign_extend(instr & 0x1FF, 9);
         break;
-    case TRAP_OUT:
-        trap_out();
+    case OP_ADD:
+        kind = (instr & 0x20) ? H_ADD_IMM : H_ADD_REG;
+        d->imm = sign_extend(instr & 0x1F, 5);
         break;
-    case TRAP_PUTS:
-        trap_puts();
+    case OP_AND:
+        kind = (instr & 0x20) ? H_AND_IMM : H_AND_REG;
+        d->imm = sign_extend(instr & 0x1F, 5);
         break;
-    case TRAP_IN:
-        trap_in();
+    case OP_NOT:
+        kind = H_NOT;
         break;
-    case TRAP_PUTSP:
-        trap_putsp();
+    case OP_LD:
+        kind = H_LD;
+        d->imm = next + sign_extend(instr & 0x1FF, 9);
         break;
-    case TRAP_HALT:
-        trap_halt();
+    case OP_LDI:
+        kind = H_LDI;
+        d->imm = next + sign_extend(instr & 0x1FF, 9);
+        break;
+    case OP_LDR:
+        kind = H_LDR;
+        d->imm = sign_extend(instr & 0x3F, 6);
+        break;
+    case OP_LEA:
+        kind = H_LEA;
+        d->imm = next + sign_extend(instr & 0x1FF, 9);
+        break;
+    case OP_ST:
+        kind = H_ST;
+        d->imm = next + sign_extend(instr & 0x1FF, 9);
+        break;
+    case OP_STI:
+        kind = H_STI;
+        d->imm = next + sign_extend(instr & 0x1FF, 9);
+        break;
+    case OP_STR:
+        kind = H_STR;
+        d->imm = sign_extend(instr & 0x3F, 6);
+        break;
+    case OP_JMP:
+        kind = H_JMP;
+        break;
+    case OP_JSR:
+        kind = (instr & 0x800) ? H_JSR : H_JSRR;
+        d->imm = next + sign_extend(instr & 0x7FF, 11);
+        break;
+    case OP_TRAP:
+        kind = H_TRAP;
+        break;
+    case OP_RTI:
+        kind = H_RTI;
         break;
     default:
-        PRINT_ERROR("Unknown trap code: %X\n", instr & 0xFF);
-        running = 0;
+        kind = H_BAD;
         break;
     }
-}
-
-// Trap Routines
-static void trap_getc(void)
-{
-    reg[R_R0] = (uint16_t)getchar();
-    update_flags(R_R0);
-}
-
-static void trap_out(void)
-{
-    putc((char)reg[R_R0], stdout);
-    fflush(stdout);
-}
 
-static void trap_puts(void)
-{
-    uint16_t *c = memory + reg[R_R0];
-    while (*c)
+    if (d != scratch && next < LC3_IO_BASE)
     {
-        putc((char)*c, stdout);
-        ++c;
+        kind = fuse(d, kind, vm->memory[next], next);
     }
-    fflush(stdout);
-}
+    d->handler = handlers[kind];
+    return d;
+}
+
+// Only device registers have access side effects, so anything outside a
+// device page is a plain load. Devices see instr_count (input is logged
+// against it, the timer counts it), so keep it current for them.
+#define LOAD(addr) (lc3_is_device(vm, (uint16_t)(addr))                          \
+                        ? (vm->instr_count = count, mem_read(vm, (uint16_t)(addr))) \
+                        : memory[(uint16_t)(addr)])
+
+// A device write may stop the machine (MCR) or enable interrupts (KBSR),
+// so the next control transfer takes the slow path
+#define STORE(addr, value)                                      \
+    do                                                          \
+    {                                                           \
+        uint16_t address = (addr);                              \
+        if (lc3_is_device(vm, address))                         \
+        {                                                       \
+            vm->instr_count = count;                            \
+            mem_write(vm, address, (value));                    \
+            if (!vm->running)                                   \
+                goto out;                                       \
+            limit = count;                                      \
+        }                                                       \
+        else                                                    \
+        {                                                       \
+            mem_write(vm, address, (value));                    \
+        }                                                       \
+    } while (0)
 
-static void trap_in(void)
-{
-    printf("Enter a character: ");
-    char c = getchar();
-    putc(c, stdout);
-    reg[R_R0] = (uint16_t)c;
-    update_flags(R_R0);
-    fflush(stdout);
-}
+// Look up the pre-decoded word at PC and jump straight to its handler
+#define DISPATCH()                                              \
+    do                                                          \
+    {                                                           \
+        d = &decoded[reg[R_PC]];                                \
+        if (!d->handler)                                        \
+            d = decode(vm, reg[R_PC], handlers, &scratch);      \
+        reg[R_PC]++;                                            \
+        count++;                                                \
+        LC3_PROF_INC(vm, op[d->instr >> 12]);                   \
+        goto *d->handler;                                       \
+    } while (0)
 
-static void trap_putsp(void)
-{
-    uint16_t *c = memory + reg[R_R0];
-    while (*c)
-    {
-        char char1 = (*c) & 0xFF;
-        putc(char1, stdout);
-        char char2 = (*c) >> 8;
-        if (char2)
-            putc(char2, stdout);
-        ++c;
-    }
-    fflush(stdout);
-}
+// The second word of a fused pair
+#define STEP_PAIR()                                             \
+    do                                                          \
+    {                                                           \
+        reg[R_PC]++;                                            \
+        count++;                                                \
+    } while (0)
 
-static void trap_halt(void)
-{
-    puts("HALT");
-    fflush(stdout);
-    running = 0;
-}
+// Branch targets are where hot code gets translated and entered.
+// Translated code is not instrumented, so profiling builds stay in the
+// interpreter.
+#if defined(LC3_JIT) && !defined(LC3_PROFILE)
+#define JIT_ENTER()                                             \
+    do                                                          \
+    {                                                           \
+        if (vm->jit)                                            \
+            count += lc3_jit_run(vm, limit - count);            \
+    } while (0)
+#else
+#define JIT_ENTER()
+#endif
+
+// Control transfers are where pending signals, the end of the
+// instruction budget or a passed deadline are noticed
+#define DISPATCH_BRANCH()                                       \
+    do                                                          \
+    {                                                           \
+        if (lc3_events_pending() || count >= limit)             \
+            goto check_limit;                                   \
+        JIT_ENTER();                                            \
+        DISPATCH();                                             \
+    } while (0)
 
-// Helper function to dump memory contents (for debugging)
-static void memory_dump(uint16_t start, uint16_t count)
-{
-    for (uint16_t i = 0; i < count; i++)
+// Direct-threaded execution loop using GCC labels-as-values. Each word is
+// decoded once into vm->decoded; mem_write drops the entry when code is
+// overwritten.
+void lc3_run_threaded(lc3_vm *vm)
+{
+    static void *const handlers[H_COUNT] = {
+        [H_NOP] = &&op_nop,
+        [H_BRN] = &&op_brn,
+        [H_BRZ] = &&op_brz,
+        [H_BRNZ] = &&op_brnz,
+        [H_BRP] = &&op_brp,
+        [H_BRNP] = &&op_brnp,
+        [H_BRZP] = &&op_brzp,
+        [H_BRNZP] = &&op_brnzp,
+        [H_ADD_REG] = &&op_add_reg,
+        [H_ADD_IMM] = &&op_add_imm,
+        [H_AND_REG] = &&op_and_reg,
+        [H_AND_IMM] = &&op_and_imm,
+        [H_NOT] = &&op_not,
+        [H_LD] = &&op_ld,
+        [H_LDI] = &&op_ldi,
+        [H_LDR] = &&op_ldr,
+        [H_LEA] = &&op_lea,
+        [H_ST] = &&op_st,
+        [H_STI] = &&op_sti,
+        [H_STR] = &&op_str,
+        [H_JMP] = &&op_jmp,
+        [H_JSR] = &&op_jsr,
+        [H_JSRR] = &&op_jsrr,
+        [H_TRAP] = &&op_trap,
+        [H_RTI] = &&op_rti,
+        [H_BAD] = &&op_bad,
+        [H_LOAD_CONST] = &&op_load_const,
+        [H_ADD_BRP] = &&op_add_brp,
+        [H_ADD_BRZ] = &&op_add_brz,
+        [H_ADD_BRZP] = &&op_add_brzp,
+        [H_ADD_BRN] = &&op_add_brn,
+        [H_ADD_BRNP] = &&op_add_brnp,
+        [H_ADD_BRNZ] = &&op_add_brnz,
+        [H_ADD_BRNZP] = &&op_add_brnzp,
+        [H_ADD_JMP] = &&op_add_jmp,
+        [H_COPY] = &&op_copy};
+
+    uint16_t *reg = vm->reg;
+    uint16_t *memory = vm->memory;
+    uint64_t count = vm->instr_count;
+    uint64_t limit = 0;
+    const lc3_insn *d;
+    lc3_insn *decoded;
+    lc3_insn scratch;
+
+    if (!vm->decoded)
     {
-        if (i % 8 == 0)
+        // calloc leaves untouched pages unbacked, so only code pages cost memory
+        vm->decoded = calloc(MEMORY_MAX, sizeof(lc3_insn));
+        if (!vm->decoded)
         {
-            printf("\n%04X: ", start + i);
+            PRINT_ERROR("Out of memory\n");
+            vm->status = LC3_STATUS_ERROR;
+            return;
         }
-        printf("%04X ", memory[start + i]);
     }
-    printf("\n");
-}
-
-// Helper function to dump register contents (for debugging)
-static void register_dump(void)
-{
-    for (int i = 0; i < R_COUNT; i++)
+    decoded = vm->decoded;
+#ifdef LC3_JIT
+    if (!vm->jit)
     {
-        printf("R%d: %04X ", i, reg[i]);
-        if (i % 3 == 2)
-            printf("\n");
+        // Without an executable buffer the interpreter simply keeps going
+        vm->jit = lc3_jit_create();
     }
-    printf("\n");
-}
+#endif
+
+    vm->running = 1;
+    vm->status = LC3_STATUS_RUNNING;
+    lc3_cond_load(vm);
+    if (lc3_interrupted() || !next_slice(vm, count, &limit))
+        goto out;
+    if (memory[MR_KBSR] & KBSR_IE)
+        limit = count;
+    DISPATCH();
+
+check_limit:
+    // An interrupt is taken right after the control transfer, before the
+    // budget is looked at, so a run that stops here has taken it already
+    // and the reference loop takes it at the same instruction
+    if (memory[MR_KBSR] & KBSR_IE)
+    {
+        vm->instr_count = count;
+        lc3_deliver_interrupts(vm);
+    }
+    if (lc3_interrupted() || !next_slice(vm, count, &limit))
+        goto out;
+    if (memory[MR_KBSR] & KBSR_IE)
+    {
+        // Keep coming back here while interrupts are enabled, and stay out
+        // of translated code, which runs past control transfers
+        limit = count + 1;
+        DISPATCH();
+    }
+    JIT_ENTER();
+    DISPATCH();
+
+op_add_reg:
+    reg[d->dr] = reg[d->sr1] + reg[d->sr2];
+    update_flags(vm, d->dr);
+    DISPATCH();
+
+op_add_imm:
+    reg[d->dr] = reg[d->sr1] + d->imm;
+    update_flags(vm, d->dr);
+    DISPATCH();
+
+op_and_reg:
+    reg[d->dr] = reg[d->sr1] & reg[d->sr2];
+    update_flags(vm, d->dr);
+    DISPATCH();
+
+op_and_imm:
+    reg[d->dr] = reg[d->sr1] & d->imm;
+    update_flags(vm, d->dr);
+    DISPATCH();
+
+op_not:
+    reg[d->dr] = ~reg[d->sr1];
+    update_flags(vm, d->dr);
+    DISPATCH();
+
+// Zeroed memory decodes as NOPs, so a guest that runs off into it must
+// still see the budget
+op_nop:
+    LC3_PROF_INC(vm, br_not_taken);
+    DISPATCH_BRANCH();
+
+// BR compares the last result directly instead of materialising N/Z/P
+op_brn:
+    if ((int16_t)vm->cc < 0)
+        goto branch_taken;
+    LC3_PROF_INC(vm, br_not_taken);
+    DISPATCH();
+
+op_brz:
+    if (vm->cc == 0)
+        goto branch_taken;
+    LC3_PROF_INC(vm, br_not_taken);
+    DISPATCH();
+
+op_brnz:
+    if ((int16_t)vm->cc <= 0)
+        goto branch_taken;
+    LC3_PROF_INC(vm, br_not_taken);
+    DISPATCH();
+
+op_brp:
+    if ((int16_t)vm->cc > 0)
+        goto branch_taken;
+    LC3_PROF_INC(vm, br_not_taken);
+    DISPATCH();
+
+op_brnp:
+    if (vm->cc != 0)
+        goto branch_taken;
+    LC3_PROF_INC(vm, br_not_taken);
+    DISPATCH();
+
+op_brzp:
+    if ((int16_t)vm->cc >= 0)
+        goto branch_taken;
+    LC3_PROF_INC(vm, br_not_taken);
+    DISPATCH();
+
+op_brnzp:
+branch_taken:
+    LC3_PROF_INC(vm, br_taken);
+    reg[R_PC] = d->imm;
+    DISPATCH_BRANCH();
+
+op_jmp:
+    reg[R_PC] = reg[d->sr1];
+    DISPATCH_BRANCH();
+
+op_jsr:
+    reg[R_R7] = reg[R_PC];
+    reg[R_PC] = d->imm;
+    DISPATCH_BRANCH();
 
-// Main execution loop (alternative implementation)
-static void execute(void)
+op_jsrr:
 {
-    while (running)
+    uint16_t target = reg[d->sr1];
+    reg[R_R7] = reg[R_PC];
+    reg[R_PC] = target;
+    DISPATCH_BRANCH();
+}
+
+op_ld:
+    reg[d->dr] = LOAD(d->imm);
+    update_flags(vm, d->dr);
+    DISPATCH();
+
+op_ldi:
+    reg[d->dr] = LOAD(LOAD(d->imm));
+    update_flags(vm, d->dr);
+    DISPATCH();
+
+op_ldr:
+    reg[d->dr] = LOAD(reg[d->sr1] + d->imm);
+    update_flags(vm, d->dr);
+    DISPATCH();
+
+op_lea:
+    reg[d->dr] = d->imm;
+    update_flags(vm, d->dr);
+    DISPATCH();
+
+op_st:
+    STORE(d->imm, reg[d->dr]);
+    DISPATCH();
+
+op_sti:
+    STORE(LOAD(d->imm), reg[d->dr]);
+    DISPATCH();
+
+op_str:
+    STORE(reg[d->sr1] + d->imm, reg[d->dr]);
+    DISPATCH();
+
+op_trap:
+    vm->instr_count = count;
+    exec_trap(vm, d->instr);
+    if (!vm->running)
+        goto out;
+    DISPATCH_BRANCH();
+
+op_rti:
+    exec_rti(vm, d->instr);
+    if (!vm->running)
+        goto out;
+    DISPATCH_BRANCH();
+
+op_load_const:
+    reg[d->dr] = d->imm;
+    update_flags(vm, d->dr);
+    STEP_PAIR();
+    DISPATCH();
+
+op_add_brp:
+    reg[d->dr] = reg[d->sr1] + d->imm;
+    update_flags(vm, d->dr);
+    STEP_PAIR();
+    if ((int16_t)vm->cc > 0)
+        goto fused_taken;
+    DISPATCH();
+
+op_add_brz:
+    reg[d->dr] = reg[d->sr1] + d->imm;
+    update_flags(vm, d->dr);
+    STEP_PAIR();
+    if (vm->cc == 0)
+        goto fused_taken;
+    DISPATCH();
+
+op_add_brzp:
+    reg[d->dr] = reg[d->sr1] + d->imm;
+    update_flags(vm, d->dr);
+    STEP_PAIR();
+    if ((int16_t)vm->cc >= 0)
+        goto fused_taken;
+    DISPATCH();
+
+op_add_brn:
+    reg[d->dr] = reg[d->sr1] + d->imm;
+    update_flags(vm, d->dr);
+    STEP_PAIR();
+    if ((int16_t)vm->cc < 0)
+        goto fused_taken;
+    DISPATCH();
+
+op_add_brnp:
+    reg[d->dr] = reg[d->sr1] + d->imm;
+    update_flags(vm, d->dr);
+    STEP_PAIR();
+    if (vm->cc != 0)
+        goto fused_taken;
+    DISPATCH();
+
+op_add_brnz:
+    reg[d->dr] = reg[d->sr1] + d->imm;
+    update_flags(vm, d->dr);
+    STEP_PAIR();
+    if ((int16_t)vm->cc <= 0)
+        goto fused_taken;
+    DISPATCH();
+
+op_add_brnzp:
+    reg[d->dr] = reg[d->sr1] + d->imm;
+    update_flags(vm, d->dr);
+    STEP_PAIR();
+fused_taken:
+    reg[R_PC] = d->instr;
+    DISPATCH_BRANCH();
+
+op_add_jmp:
+    reg[d->dr] = reg[d->sr1] + d->imm;
+    update_flags(vm, d->dr);
+    STEP_PAIR();
+    reg[R_PC] = reg[d->sr2];
+    DISPATCH_BRANCH();
+
+op_copy:
+    reg[d->dr] = LOAD(reg[d->sr1] + d->imm);
+    update_flags(vm, d->dr);
+    STEP_PAIR();
+    STORE(reg[d->sr2] + d->instr, reg[d->dr]);
+    DISPATCH();
+
+op_bad:
+    lc3_exception(vm, LC3_EXC_ILLEGAL);
+    if (vm->running)
+        DISPATCH_BRANCH();
+
+out:
+    vm->instr_count = count;
+    finish_status(vm);
+    lc3_cond_save(vm);
+    lc3_out_flush(vm);
+    vm->running = 0;
+}
+
+#undef LOAD
+#undef STORE
+#undef STEP_PAIR
+#undef JIT_ENTER
+#undef DISPATCH
+#undef DISPATCH_BRANCH
+
+#endif // LC3_HAVE_THREADED_DISPATCH
+
+// Main execution loop. The sampling profiler and the tracer run on the
+// reference loop: it checks after every instruction, so samples land on the
+// exact PC instead of the next branch target, and every instruction and
+// store can be recorded.
+void lc3_run(lc3_vm *vm)
+{
+    if (vm->sampler || vm->tracer)
     {
-        uint16_t instr = mem_read(reg[R_PC]++);
-        uint16_t op = instr >> 12;
-
-        switch (op)
-        {
-        case OP_ADD:
-            exec_add(instr);
-            break;
-        case OP_AND:
-            exec_and(instr);
-            break;
-        case OP_BR:
-            exec_br(instr);
-            break;
-        case OP_JMP:
-            exec_jmp(instr);
-            break;
-        case OP_JSR:
-            exec_jsr(instr);
-            break;
-        case OP_LD:
-            exec_ld(instr);
-            break;
-        case OP_LDI:
-            exec_ldi(instr);
-            break;
-        case OP_LDR:
-            exec_ldr(instr);
-            break;
-        case OP_LEA:
-            exec_lea(instr);
-            break;
-        case OP_NOT:
-            exec_not(instr);
-            break;
-        case OP_ST:
-            exec_st(instr);
-            break;
-        case OP_STI:
-            exec_sti(instr);
-            break;
-        case OP_STR:
-            exec_str(instr);
-            break;
-        case OP_TRAP:
-            exec_trap(instr);
-            break;
-        case OP_RES:
-        case OP_RTI:
-        default:
-            PRINT_ERROR("BAD OPCODE: %d\n", op);
-            running = 0;
-            break;
-        }
-
-        // register_dump();
-        // memory_dump(PC_START, 16);
+        lc3_run_switch(vm);
+        return;
     }
+#if defined(LC3_THREADED_DISPATCH) && defined(LC3_HAVE_THREADED_DISPATCH)
+    lc3_run_threaded(vm);
+#else
+    lc3_run_switch(vm);
+#endif
 }
 
-int main(int argc, char *argv[])
+// Run engine for at most n more instructions, as far as it checks
+static int run_slice(lc3_vm *vm, uint64_t n, void (*engine)(lc3_vm *))
 {
-    if (argc < 2)
-    {
-        PRINT_ERROR("Usage: %s <image-file1> ...\n", argv[0]);
-        exit(2);
-    }
+    uint64_t limit = vm->instr_limit;
+    uint64_t left = vm->instr_count < limit ? limit - vm->instr_count : 0;
 
-    for (int j = 1; j < argc; ++j)
+    if (n < left)
     {
-        if (!read_image(argv[j]))
-        {
-            EXIT_WITH_ERROR("Failed to load image: %s\n", argv[j]);
-        }
+        vm->instr_limit = vm->instr_count + n;
     }
+    engine(vm);
+    vm->instr_limit = limit;
 
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
-
-    // Set the PC to starting position
-    // 0x3000 is the default
-    enum
+    if (vm->status == LC3_STATUS_BUDGET && vm->instr_count < limit)
     {
-        PC_START = 0x3000
-    };
-    reg[R_PC] = PC_START;
+        vm->status = LC3_STATUS_PAUSED;
+    }
+    return vm->status;
+}
 
-    execute();
+// Run at most about n more instructions (a translated block is never cut
+// short) and return the status. LC3_STATUS_PAUSED means the slice ran out
+// first; calling again resumes where the guest left off.
+int lc3_run_for(lc3_vm *vm, uint64_t n)
+{
+    return run_slice(vm, n, lc3_run);
+}
 
-    restore_input_buffering();
-    return 0;
-}
\ No newline at end of file
+// Run exactly one instruction; the reference loop checks the limit after
+// every instruction
+int lc3_step(lc3_vm *vm)
+{
+    return run_slice(vm, 1, lc3_run_switch);
+}
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "lc3.h"
+
+// Copy-on-write forks.
+//
+// Guest memory is read directly by every engine, so copy-on-write is left
+// to the MMU rather than mem_write: the parent's memory is written once to
+// an anonymous file, and parent and children all map that file privately
+// over their memory arrays. A page is copied the first time one of them
+// writes to it. The image is reused for further forks until the parent
+// stores to memory again (tracked with LC3_DIRTY_FORK).
+//
+// Without memfd_create a fork falls back to copying memory.
+
+#define COW_BYTES (MEMORY_MAX * sizeof(uint16_t))
+
+struct lc3_cow
+{
+    int fd;
+    int refs;
+};
+
+static void cow_put(struct lc3_cow *cow)
+{
+    if (cow && __atomic_sub_fetch(&cow->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        close(cow->fd);
+        free(cow);
+    }
+}
+
+// Map the image over vm->memory
+static int cow_map(lc3_vm *vm, struct lc3_cow *cow)
+{
+    void *p = mmap(vm->memory, COW_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, cow->fd, 0);
+    if (p == MAP_FAILED)
+    {
+        return 0;
+    }
+    __atomic_add_fetch(&cow->refs, 1, __ATOMIC_RELAXED);
+    cow_put(vm->cow);
+    vm->cow = cow;
+    for (size_t page = 0; page < LC3_PAGE_COUNT; ++page)
+    {
+        vm->dirty[page] &= ~LC3_DIRTY_FORK;
+    }
+    return 1;
+}
+
+#ifdef MFD_CLOEXEC
+// Freeze the parent's current memory into a new shared image
+static struct lc3_cow *cow_freeze(lc3_vm *vm)
+{
+    struct lc3_cow *cow = malloc(sizeof(*cow));
+    if (!cow)
+    {
+        return NULL;
+    }
+    cow->fd = memfd_create("lc3-memory", MFD_CLOEXEC);
+    cow->refs = 1;
+    if (cow->fd < 0)
+    {
+        free(cow);
+        return NULL;
+    }
+
+    const char *p = (const char *)vm->memory;
+    size_t done = 0;
+    while (done < COW_BYTES)
+    {
+        ssize_t n = pwrite(cow->fd, p + done, COW_BYTES - done, (off_t)done);
+        if (n <= 0)
+        {
+            cow_put(cow);
+            return NULL;
+        }
+        done += (size_t)n;
+    }
+
+    // The file now holds the same bytes, so remapping is invisible
+    int ok = cow_map(vm, cow);
+    cow_put(cow);
+    return ok ? cow : NULL;
+}
+#endif
+
+static struct lc3_cow *cow_image(lc3_vm *vm)
+{
+    if (vm->cow)
+    {
+        int clean = 1;
+        for (size_t page = 0; page < LC3_PAGE_COUNT && clean; ++page)
+        {
+            clean = !(vm->dirty[page] & LC3_DIRTY_FORK);
+        }
+        if (clean)
+        {
+            return vm->cow;
+        }
+    }
+#ifdef MFD_CLOEXEC
+    return cow_freeze(vm);
+#else
+    return NULL;
+#endif
+}
+
+// Create a VM in the parent's current state that shares its memory pages
+// until either side writes to them. Neither VM may be running.
+lc3_vm *lc3_fork(lc3_vm *parent)
+{
+    if (parent->running)
+    {
+        return NULL;
+    }
+
+    lc3_vm *child = lc3_create();
+    if (!child)
+    {
+        return NULL;
+    }
+
+    // Output already produced belongs to the parent alone; later output
+    // goes the same way, to the same callback
+    lc3_out_flush(parent);
+    lc3_out_init(child, parent->out.fd, parent->out.policy);
+    child->out.write = parent->out.write;
+    child->out.write_ctx = parent->out.write_ctx;
+
+    struct lc3_cow *cow = cow_image(parent);
+    if (!cow || !cow_map(child, cow))
+    {
+        memcpy(child->memory, parent->memory, sizeof(child->memory));
+    }
+
+    memcpy(child->reg, parent->reg, sizeof(child->reg));
+    child->cc = parent->cc;
+    child->psr = parent->psr;
+    child->saved_ssp = parent->saved_ssp;
+    child->saved_usp = parent->saved_usp;
+    child->instr_count = parent->instr_count;
+    child->snapshot_id = parent->snapshot_id;
+    // Devices attached to the parent, with their contexts, carry over
+    child->bus = parent->bus;
+    if (parent->os && !lc3_os_enable(child))
+    {
+        lc3_destroy(child);
+        return NULL;
+    }
+    for (size_t page = 0; page < LC3_PAGE_COUNT; ++page)
+    {
+        child->dirty[page] = (parent->dirty[page] & LC3_DIRTY_SNAPSHOT) | (child->cow ? 0 : LC3_DIRTY_FORK);
+    }
+    return child;
+}
+
+// Drop the VM's reference to its fork image; its mapping stays valid
+void lc3_fork_release(lc3_vm *vm)
+{
+    cow_put(vm->cow);
+    vm->cow = NULL;
+}
@@ -0,0 +1,232 @@
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "lc3.h"
+
+// Keyboard input: a reader thread (or the host, via lc3_in_push) produces
+// bytes into a single-producer/single-consumer ring and the VM consumes
+// them. The consumer side never makes a syscall unless it has to block.
+
+#define IN_MASK (LC3_IN_BUFFER_SIZE - 1)
+
+#define LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+void lc3_in_init(lc3_vm *vm)
+{
+    lc3_input *in = &vm->in;
+    in->fd = -1;
+    in->attached = 0;
+    in->thread_running = 0;
+    in->head = 0;
+    in->tail = 0;
+    in->eof = 0;
+    in->waiting = 0;
+    in->read = NULL;
+    in->read_ctx = NULL;
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->ready, NULL);
+}
+
+// Wake a consumer sleeping in lc3_in_getc
+static void wake_consumer(lc3_input *in)
+{
+    pthread_mutex_lock(&in->lock);
+    if (in->waiting)
+    {
+        pthread_cond_broadcast(&in->ready);
+    }
+    pthread_mutex_unlock(&in->lock);
+}
+
+static void *reader_thread(void *arg)
+{
+    lc3_input *in = arg;
+
+    for (;;)
+    {
+        size_t tail = in->tail;
+        size_t room = LC3_IN_BUFFER_SIZE - (tail - LOAD_ACQUIRE(&in->head));
+        if (room == 0)
+        {
+            // The guest is not keeping up; back off instead of spinning
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        size_t start = tail & IN_MASK;
+        size_t chunk = LC3_IN_BUFFER_SIZE - start < room ? LC3_IN_BUFFER_SIZE - start : room;
+        ssize_t n = read(in->fd, in->buf + start, chunk);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            STORE_RELEASE(&in->eof, 1);
+            wake_consumer(in);
+            return NULL;
+        }
+
+        STORE_RELEASE(&in->tail, tail + (size_t)n);
+        wake_consumer(in);
+    }
+}
+
+int lc3_in_start(lc3_vm *vm, int fd)
+{
+    lc3_input *in = &vm->in;
+    in->fd = fd;
+    in->attached = 1;
+    if (pthread_create(&in->thread, NULL, reader_thread, in) != 0)
+    {
+        in->attached = 0;
+        return 0;
+    }
+    in->thread_running = 1;
+    return 1;
+}
+
+static void stop_reader(lc3_input *in)
+{
+    if (in->thread_running)
+    {
+        // The reader is normally parked in read(), a cancellation point
+        pthread_cancel(in->thread);
+        pthread_join(in->thread, NULL);
+        in->thread_running = 0;
+    }
+}
+
+// Detach any producer and drop buffered input so the VM can be reused
+void lc3_in_reset(lc3_vm *vm)
+{
+    lc3_input *in = &vm->in;
+    stop_reader(in);
+    in->fd = -1;
+    in->attached = 0;
+    in->head = 0;
+    in->tail = 0;
+    in->eof = 0;
+    in->waiting = 0;
+    in->read = NULL;
+    in->read_ctx = NULL;
+}
+
+void lc3_in_stop(lc3_vm *vm)
+{
+    lc3_input *in = &vm->in;
+    stop_reader(in);
+    pthread_mutex_destroy(&in->lock);
+    pthread_cond_destroy(&in->ready);
+}
+
+// Host-side producer for embedding; must not be mixed with lc3_in_start.
+// Returns the number of bytes accepted.
+size_t lc3_in_push(lc3_vm *vm, const void *data, size_t len)
+{
+    lc3_input *in = &vm->in;
+    const uint8_t *bytes = data;
+    size_t tail = in->tail;
+    size_t room = LC3_IN_BUFFER_SIZE - (tail - LOAD_ACQUIRE(&in->head));
+    size_t n = len < room ? len : room;
+
+    in->attached = 1;
+    for (size_t i = 0; i < n; ++i)
+    {
+        in->buf[(tail + i) & IN_MASK] = bytes[i];
+    }
+    STORE_RELEASE(&in->tail, tail + n);
+    wake_consumer(in);
+    return n;
+}
+
+// Embedding: ask fn for a byte whenever the guest wants one and the ring is
+// empty. A negative result ends input.
+void lc3_set_input(lc3_vm *vm, lc3_input_fn fn, void *ctx)
+{
+    vm->in.read = fn;
+    vm->in.read_ctx = ctx;
+}
+
+void lc3_in_close(lc3_vm *vm)
+{
+    vm->in.attached = 1;
+    STORE_RELEASE(&vm->in.eof, 1);
+    wake_consumer(&vm->in);
+}
+
+// Take the next byte if one is buffered; -1 if none. At end of input this
+// reports EOF (0xFFFF) as an available key, as getchar() used to.
+int lc3_in_poll(lc3_vm *vm)
+{
+    return vm->input_log ? lc3_input_log_read(vm, LC3_INPUT_POLL) : lc3_in_take(vm);
+}
+
+// Block until a byte arrives, input ends or SIGINT is raised
+int lc3_in_getc(lc3_vm *vm)
+{
+    return vm->input_log ? lc3_input_log_read(vm, LC3_INPUT_GETC) : lc3_in_wait(vm);
+}
+
+// lc3_in_poll on the ring itself, bypassing any input log
+int lc3_in_take(lc3_vm *vm)
+{
+    lc3_input *in = &vm->in;
+    size_t head = in->head;
+
+    if (head != LOAD_ACQUIRE(&in->tail))
+    {
+        int c = in->buf[head & IN_MASK];
+        STORE_RELEASE(&in->head, head + 1);
+        return c;
+    }
+    if (in->read && !LOAD_ACQUIRE(&in->eof))
+    {
+        int c = in->read(in->read_ctx);
+        if (c >= 0)
+            return c & 0xFF;
+        STORE_RELEASE(&in->eof, 1);
+    }
+    if (!in->attached || LOAD_ACQUIRE(&in->eof))
+    {
+        return 0xFFFF;
+    }
+    return -1;
+}
+
+// lc3_in_getc on the ring itself, bypassing any input log
+int lc3_in_wait(lc3_vm *vm)
+{
+    lc3_input *in = &vm->in;
+    int c;
+
+    while ((c = lc3_in_take(vm)) < 0)
+    {
+        if (lc3_interrupted())
+        {
+            return 0xFFFF;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&in->lock);
+        in->waiting = 1;
+        if (LOAD_ACQUIRE(&in->tail) == in->head && !LOAD_ACQUIRE(&in->eof))
+        {
+            pthread_cond_timedwait(&in->ready, &in->lock, &deadline);
+        }
+        in->waiting = 0;
+        pthread_mutex_unlock(&in->lock);
+    }
+    return c;
+}
@@ -1,12 +1,6 @@
 #include "lc3.h"
 
-extern uint16_t reg[R_COUNT];
-extern uint16_t mem_read(uint16_t address);
-extern void mem_write(uint16_t address, uint16_t val);
-extern void update_flags(uint16_t r);
-extern uint16_t sign_extend(uint16_t x, int bit_count);
-
-void exec_add(uint16_t instr)
+void exec_add(lc3_vm *vm, uint16_t instr)
 {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t r1 = (instr >> 6) & 0x7;
@@ -15,18 +9,18 @@ void exec_add(uint16_t instr)
     if (imm_flag)
     {
         uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-        reg[r0] = reg[r1] + imm5;
+        vm->reg[r0] = vm->reg[r1] + imm5;
     }
     else
     {
         uint16_t r2 = instr & 0x7;
-        reg[r0] = reg[r1] + reg[r2];
+        vm->reg[r0] = vm->reg[r1] + vm->reg[r2];
     }
 
-    update_flags(r0);
+    update_flags(vm, r0);
 }
 
-void exec_and(uint16_t instr)
+void exec_and(lc3_vm *vm, uint16_t instr)
 {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t r1 = (instr >> 6) & 0x7;
@@ -35,108 +29,123 @@ void exec_and(uint16_t instr)
     if (imm_flag)
     {
         uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-        reg[r0] = reg[r1] & imm5;
+        vm->reg[r0] = vm->reg[r1] & imm5;
     }
     else
     {
         uint16_t r2 = instr & 0x7;
-        reg[r0] = reg[r1] & reg[r2];
+        vm->reg[r0] = vm->reg[r1] & vm->reg[r2];
     }
 
-    update_flags(r0);
+    update_flags(vm, r0);
 }
 
-void exec_not(uint16_t instr)
+void exec_not(lc3_vm *vm, uint16_t instr)
 {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t r1 = (instr >> 6) & 0x7;
-    reg[r0] = ~reg[r1];
-    update_flags(r0);
+    vm->reg[r0] = ~vm->reg[r1];
+    update_flags(vm, r0);
 }
 
-void exec_br(uint16_t instr)
+void exec_br(lc3_vm *vm, uint16_t instr)
 {
     uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
     uint16_t cond_flag = (instr >> 9) & 0x7;
-    if (cond_flag & reg[R_COND])
+    if (cond_flag & cond_flags(vm->cc))
+    {
+        LC3_PROF_INC(vm, br_taken);
+        vm->reg[R_PC] += pc_offset;
+    }
+    else
     {
-        reg[R_PC] += pc_offset;
+        LC3_PROF_INC(vm, br_not_taken);
     }
 }
 
-void exec_jmp(uint16_t instr)
+void exec_jmp(lc3_vm *vm, uint16_t instr)
 {
     uint16_t r1 = (instr >> 6) & 0x7;
-    reg[R_PC] = reg[r1];
+    vm->reg[R_PC] = vm->reg[r1];
+    if (vm->sampler && r1 == R_R7)
+    {
+        lc3_sampler_return(vm);
+    }
 }
 
-void exec_jsr(uint16_t instr)
+void exec_jsr(lc3_vm *vm, uint16_t instr)
 {
     uint16_t long_flag = (instr >> 11) & 1;
-    reg[R_R7] = reg[R_PC];
+    uint16_t return_pc = vm->reg[R_PC];
     if (long_flag)
     {
         uint16_t long_pc_offset = sign_extend(instr & 0x7FF, 11);
-        reg[R_PC] += long_pc_offset;
+        vm->reg[R_PC] += long_pc_offset;
     }
     else
     {
+        // Read the base register first so that JSRR R7 jumps to the old R7
         uint16_t r1 = (instr >> 6) & 0x7;
-        reg[R_PC] = reg[r1];
+        vm->reg[R_PC] = vm->reg[r1];
+    }
+    vm->reg[R_R7] = return_pc;
+    if (vm->sampler)
+    {
+        lc3_sampler_call(vm, vm->reg[R_PC]);
     }
 }
 
-void exec_ld(uint16_t instr)
+void exec_ld(lc3_vm *vm, uint16_t instr)
 {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    reg[r0] = mem_read(reg[R_PC] + pc_offset);
-    update_flags(r0);
+    vm->reg[r0] = mem_read(vm, vm->reg[R_PC] + pc_offset);
+    update_flags(vm, r0);
 }
 
-void exec_ldi(uint16_t instr)
+void exec_ldi(lc3_vm *vm, uint16_t instr)
 {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    reg[r0] = mem_read(mem_read(reg[R_PC] + pc_offset));
-    update_flags(r0);
+    vm->reg[r0] = mem_read(vm, mem_read(vm, vm->reg[R_PC] + pc_offset));
+    update_flags(vm, r0);
 }
 
-void exec_ldr(uint16_t instr)
+void exec_ldr(lc3_vm *vm, uint16_t instr)
 {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t r1 = (instr >> 6) & 0x7;
     uint16_t offset = sign_extend(instr & 0x3F, 6);
-    reg[r0] = mem_read(reg[r1] + offset);
-    update_flags(r0);
+    vm->reg[r0] = mem_read(vm, vm->reg[r1] + offset);
+    update_flags(vm, r0);
 }
 
-void exec_lea(uint16_t instr)
+void exec_lea(lc3_vm *vm, uint16_t instr)
 {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    reg[r0] = reg[R_PC] + pc_offset;
-    update_flags(r0);
+    vm->reg[r0] = vm->reg[R_PC] + pc_offset;
+    update_flags(vm, r0);
 }
 
-void exec_st(uint16_t instr)
+void exec_st(lc3_vm *vm, uint16_t instr)
 {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    mem_write(reg[R_PC] + pc_offset, reg[r0]);
+    mem_write(vm, vm->reg[R_PC] + pc_offset, vm->reg[r0]);
 }
 
-void exec_sti(uint16_t instr)
+void exec_sti(lc3_vm *vm, uint16_t instr)
 {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    mem_write(mem_read(reg[R_PC] + pc_offset), reg[r0]);
+    mem_write(vm, mem_read(vm, vm->reg[R_PC] + pc_offset), vm->reg[r0]);
 }
 
-void exec_str(uint16_t instr)
+void exec_str(lc3_vm *vm, uint16_t instr)
 {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t r1 = (instr >> 6) & 0x7;
     uint16_t offset = sign_extend(instr & 0x3F, 6);
-    mem_write(reg[r1] + offset, reg[r0]);
+    mem_write(vm, vm->reg[r1] + offset, vm->reg[r0]);
 }
\ No newline at end of file
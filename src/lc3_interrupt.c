@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include "lc3.h"
+
+#define PRINT_ERROR(...) fprintf(stderr, "Error: " __VA_ARGS__)
+
+// Privilege modes, interrupts and RTI.
+//
+// vm->psr holds the privilege bit and priority level of the PSR; its
+// condition codes stay in vm->cc, so lc3_psr puts the two together. The
+// stack pointer of the mode not running (R6 is the one that is) is kept in
+// saved_ssp or saved_usp.
+//
+// Interrupts and exceptions push the PSR and PC on the supervisor stack and
+// continue at the address in the interrupt vector table (LC3_INT_TABLE +
+// vector); RTI pops them again. The engines look for a keyboard interrupt
+// only at control transfers, and only while KBSR has interrupts enabled.
+
+uint16_t lc3_psr(const lc3_vm *vm)
+{
+    return vm->psr | cond_flags(vm->cc);
+}
+
+void lc3_set_psr(lc3_vm *vm, uint16_t psr)
+{
+    vm->psr = psr & (PSR_USER | PSR_PRIORITY_MASK);
+    vm->reg[R_COND] = psr & (FL_NEG | FL_ZRO | FL_POS);
+    if (!vm->reg[R_COND])
+    {
+        vm->reg[R_COND] = FL_ZRO;
+    }
+    lc3_cond_load(vm);
+}
+
+// Enter the handler for vector in supervisor mode. priority is the new
+// priority level, or -1 to keep the current one (exceptions).
+void lc3_raise(lc3_vm *vm, uint8_t vector, int priority)
+{
+    uint16_t psr = lc3_psr(vm);
+
+    if (psr & PSR_USER)
+    {
+        vm->saved_usp = vm->reg[R_R6];
+        vm->reg[R_R6] = vm->saved_ssp;
+    }
+    mem_write(vm, --vm->reg[R_R6], psr);
+    mem_write(vm, --vm->reg[R_R6], vm->reg[R_PC]);
+
+    vm->psr = priority < 0 ? psr & PSR_PRIORITY_MASK : (uint16_t)(priority << 8);
+    vm->reg[R_PC] = mem_read(vm, LC3_INT_TABLE + vector);
+}
+
+// Raise an exception, or stop with LC3_STATUS_BAD_OPCODE if its vector is
+// empty: without a handler the guest would continue at x0000
+void lc3_exception(lc3_vm *vm, uint8_t vector)
+{
+    if (vm->memory[LC3_INT_TABLE + vector])
+    {
+        lc3_raise(vm, vector, -1);
+        return;
+    }
+
+    lc3_out_flush(vm);
+    if (vector == LC3_EXC_PRIVILEGE)
+    {
+        PRINT_ERROR("PRIVILEGE VIOLATION: RTI in user mode at x%04X\n", (uint16_t)(vm->reg[R_PC] - 1));
+    }
+    else
+    {
+        PRINT_ERROR("BAD OPCODE: %d\n", OP_RES);
+    }
+    vm->status = LC3_STATUS_BAD_OPCODE;
+    vm->running = 0;
+}
+
+void exec_rti(lc3_vm *vm, uint16_t instr)
+{
+    (void)instr;
+    if (vm->psr & PSR_USER)
+    {
+        lc3_exception(vm, LC3_EXC_PRIVILEGE);
+        return;
+    }
+
+    uint16_t pc = mem_read(vm, vm->reg[R_R6]++);
+    uint16_t psr = mem_read(vm, vm->reg[R_R6]++);
+    vm->reg[R_PC] = pc;
+    lc3_set_psr(vm, psr);
+    if (psr & PSR_USER)
+    {
+        vm->saved_ssp = vm->reg[R_R6];
+        vm->reg[R_R6] = vm->saved_usp;
+    }
+}
+
+// Called by the engines right after a control transfer (a taken BR, JMP,
+// JSR, TRAP or RTI) while KBSR bit 14 is set: raise the keyboard interrupt
+// if a key is waiting and the current priority is below it. Returns 1 if
+// the interrupt was taken.
+int lc3_deliver_interrupts(lc3_vm *vm)
+{
+    if (((vm->psr & PSR_PRIORITY_MASK) >> 8) >= LC3_PRIORITY_KEYBOARD || !lc3_keyboard_ready(vm))
+    {
+        return 0;
+    }
+    lc3_raise(vm, LC3_INT_KEYBOARD, LC3_PRIORITY_KEYBOARD);
+    return 1;
+}
@@ -0,0 +1,252 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "lc3.h"
+
+#define OUT_MASK (LC3_OUT_BUFFER_SIZE - 1)
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void lc3_out_init(lc3_vm *vm, int fd, int policy)
+{
+    lc3_output *out = &vm->out;
+    out->fd = fd;
+    out->policy = policy;
+    out->newline = 0;
+    out->head = 0;
+    out->tail = 0;
+    out->first_ms = 0;
+    out->write = NULL;
+    out->write_ctx = NULL;
+    free(out->capture);
+    out->capture = NULL;
+    out->capture_len = 0;
+    out->capture_cap = 0;
+}
+
+// Embedding: hand flushed output to fn, or keep it for lc3_out_take if fn
+// is NULL. Anything already buffered goes out the old way first; captured
+// output not yet taken is dropped.
+void lc3_set_output(lc3_vm *vm, lc3_output_fn fn, void *ctx)
+{
+    lc3_out_flush(vm);
+    lc3_out_init(vm, fn ? LC3_OUT_CALLBACK : LC3_OUT_CAPTURE, vm->out.policy);
+    vm->out.write = fn;
+    vm->out.write_ctx = ctx;
+}
+
+// Append pending bytes to the capture buffer
+static int capture_flush(lc3_output *out)
+{
+    size_t pending = out->tail - out->head;
+    size_t needed = out->capture_len + pending;
+
+    if (needed > out->capture_cap)
+    {
+        size_t cap = out->capture_cap ? out->capture_cap : LC3_OUT_BUFFER_SIZE;
+        while (cap < needed)
+            cap *= 2;
+        char *grown = realloc(out->capture, cap);
+        if (!grown)
+        {
+            out->head = out->tail;
+            out->newline = 0;
+            return 0;
+        }
+        out->capture = grown;
+        out->capture_cap = cap;
+    }
+
+    for (; out->head != out->tail; ++out->head)
+    {
+        out->capture[out->capture_len++] = out->buf[out->head & OUT_MASK];
+    }
+    out->newline = 0;
+    return 1;
+}
+
+// Pass pending bytes to the output callback, in at most two pieces
+static void callback_flush(lc3_output *out)
+{
+    while (out->head != out->tail)
+    {
+        size_t start = out->head & OUT_MASK;
+        size_t pending = out->tail - out->head;
+        size_t len = LC3_OUT_BUFFER_SIZE - start < pending ? LC3_OUT_BUFFER_SIZE - start : pending;
+        out->write(out->write_ctx, out->buf + start, len);
+        out->head += len;
+    }
+    out->newline = 0;
+}
+
+// Hand over everything captured so far (LC3_OUT_CAPTURE only); the caller
+// frees the result, which may be NULL when nothing was written
+char *lc3_out_take(lc3_vm *vm, size_t *len)
+{
+    lc3_output *out = &vm->out;
+    lc3_out_flush(vm);
+
+    char *data = out->capture;
+    *len = out->capture_len;
+    out->capture = NULL;
+    out->capture_len = 0;
+    out->capture_cap = 0;
+    return data;
+}
+
+// Write everything pending with as few writev calls as possible. Returns 0
+// if the descriptor failed; the pending bytes are dropped in that case.
+int lc3_out_flush(lc3_vm *vm)
+{
+    lc3_output *out = &vm->out;
+
+    if (out->fd == LC3_OUT_CAPTURE)
+    {
+        return capture_flush(out);
+    }
+    if (out->fd == LC3_OUT_CALLBACK)
+    {
+        callback_flush(out);
+        return 1;
+    }
+
+    while (out->head != out->tail)
+    {
+        size_t start = out->head & OUT_MASK;
+        size_t pending = out->tail - out->head;
+        size_t first = LC3_OUT_BUFFER_SIZE - start;
+        struct iovec iov[2];
+        int count = 1;
+
+        iov[0].iov_base = out->buf + start;
+        iov[0].iov_len = pending < first ? pending : first;
+        if (pending > first)
+        {
+            iov[1].iov_base = out->buf;
+            iov[1].iov_len = pending - first;
+            count = 2;
+        }
+
+        ssize_t written = writev(out->fd, iov, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            out->head = out->tail;
+            out->newline = 0;
+            return 0;
+        }
+        out->head += (size_t)written;
+    }
+
+    out->newline = 0;
+    return 1;
+}
+
+void lc3_out_putc(lc3_vm *vm, char c)
+{
+    lc3_output *out = &vm->out;
+
+    if (out->tail - out->head == LC3_OUT_BUFFER_SIZE)
+    {
+        lc3_out_flush(vm);
+    }
+    if (out->head == out->tail && out->policy == LC3_FLUSH_BLOCK)
+    {
+        out->first_ms = now_ms();
+    }
+    out->buf[out->tail++ & OUT_MASK] = c;
+    if (c == '\n')
+    {
+        out->newline = 1;
+    }
+}
+
+// Contiguous free space at the end of the buffer, flushing first if it is
+// full. Fill some of it and pass the count to lc3_out_commit.
+char *lc3_out_reserve(lc3_vm *vm, size_t *room)
+{
+    lc3_output *out = &vm->out;
+
+    if (out->tail - out->head == LC3_OUT_BUFFER_SIZE)
+    {
+        lc3_out_flush(vm);
+    }
+    size_t start = out->tail & OUT_MASK;
+    size_t free_bytes = LC3_OUT_BUFFER_SIZE - (out->tail - out->head);
+    size_t to_end = LC3_OUT_BUFFER_SIZE - start;
+    *room = free_bytes < to_end ? free_bytes : to_end;
+    return out->buf + start;
+}
+
+void lc3_out_commit(lc3_vm *vm, size_t len)
+{
+    lc3_output *out = &vm->out;
+
+    if (!len)
+    {
+        return;
+    }
+    if (out->head == out->tail && out->policy == LC3_FLUSH_BLOCK)
+    {
+        out->first_ms = now_ms();
+    }
+    if (memchr(out->buf + (out->tail & OUT_MASK), '\n', len))
+    {
+        out->newline = 1;
+    }
+    out->tail += len;
+}
+
+void lc3_out_write(lc3_vm *vm, const char *s, size_t len)
+{
+    while (len)
+    {
+        size_t room;
+        char *dst = lc3_out_reserve(vm, &room);
+        size_t n = len < room ? len : room;
+        memcpy(dst, s, n);
+        lc3_out_commit(vm, n);
+        s += n;
+        len -= n;
+    }
+}
+
+// Apply the flush policy after a trap or DDR write has produced output, and
+// from the engines' slice checks while block-buffered output waits
+void lc3_out_sync(lc3_vm *vm)
+{
+    lc3_output *out = &vm->out;
+
+    if (out->head == out->tail)
+    {
+        return;
+    }
+
+    switch (out->policy)
+    {
+    case LC3_FLUSH_IMMEDIATE:
+        lc3_out_flush(vm);
+        break;
+    case LC3_FLUSH_LINE:
+        if (out->newline)
+            lc3_out_flush(vm);
+        break;
+    default:
+        if (now_ms() - out->first_ms >= LC3_OUT_FLUSH_MS)
+            lc3_out_flush(vm);
+        break;
+    }
+}
@@ -0,0 +1,714 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include "lc3.h"
+
+// Basic-block translator from LC-3 to x86-64.
+//
+// Host register assignment inside a block:
+//   rdi      lc3_vm *
+//   rsi      vm->decoded (entries are cleared on stores, as mem_write does)
+//   rbp      jit->code_map (non-zero for guest addresses covered by a block)
+//            and through it jit->loop_limit
+//   ebx      vm->cc, sign-extended to 32 bits
+//   edx      instructions retired by native self-loops, pre-shifted by 16
+//   r8-r15   guest R0-R7
+//   rax, rcx scratch
+//
+// A block returns next PC | retired << 16 | LC3_JIT_CODE_WRITE, after
+// writing the guest registers and the condition-code source back.
+//
+// The buffer is never writable and executable at once: it is mapped
+// read-write and switched to read-execute after each block is emitted.
+
+#define LC3_JIT_THRESHOLD 50
+#define LC3_JIT_NEVER 0xFF
+#define LC3_JIT_BUFFER_SIZE (4 << 20)
+#define LC3_JIT_MAX_BLOCK 64
+#define LC3_JIT_MAX_RETIRED 0x7FFF
+#define LC3_JIT_CODE_WRITE 0x80000000u
+
+typedef uint32_t (*lc3_jit_block)(lc3_vm *vm);
+
+struct lc3_jit
+{
+    lc3_jit_block blocks[MEMORY_MAX];
+    uint8_t hits[MEMORY_MAX];
+    uint8_t code_map[MEMORY_MAX];
+    uint32_t loop_limit; // self-loops exit once edx reaches this
+    uint8_t *buffer;
+    size_t used;
+};
+
+enum
+{
+    RAX = 0,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI
+};
+
+// Condition codes for jcc
+enum
+{
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_L = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G = 0xF
+};
+
+#define GUEST(r) (8 + (r))
+#define REG_DISP(r) ((int32_t)(offsetof(lc3_vm, reg) + (r) * sizeof(uint16_t)))
+#define CC_DISP ((int32_t)offsetof(lc3_vm, cc))
+#define MEM_DISP(a) ((int32_t)(offsetof(lc3_vm, memory) + (a) * sizeof(uint16_t)))
+#define DIRTY_DISP ((int32_t)offsetof(lc3_vm, dirty))
+#define LOOP_LIMIT_DISP ((int32_t)(offsetof(struct lc3_jit, loop_limit) - offsetof(struct lc3_jit, code_map)))
+
+typedef struct
+{
+    uint8_t *p;
+    uint8_t *end;
+    int overflow;
+} emitter;
+
+static void emit8(emitter *e, uint8_t b)
+{
+    if (e->p < e->end)
+        *e->p++ = b;
+    else
+        e->overflow = 1;
+}
+
+static void emit16(emitter *e, uint16_t v)
+{
+    emit8(e, v & 0xFF);
+    emit8(e, v >> 8);
+}
+
+static void emit32(emitter *e, uint32_t v)
+{
+    emit16(e, v & 0xFFFF);
+    emit16(e, v >> 16);
+}
+
+static void emit_rex(emitter *e, int w, int r, int x, int b)
+{
+    if (w || r >= 8 || x >= 8 || b >= 8)
+        emit8(e, 0x40 | (w ? 8 : 0) | (r >= 8 ? 4 : 0) | (x >= 8 ? 2 : 0) | (b >= 8 ? 1 : 0));
+}
+
+static uint8_t modrm(int mod, int reg, int rm)
+{
+    return (mod << 6) | ((reg & 7) << 3) | (rm & 7);
+}
+
+// op r/m16, r16 (mov 0x89, add 0x01, and 0x21)
+static void emit_rr16(emitter *e, uint8_t opcode, int dst, int src)
+{
+    emit8(e, 0x66);
+    emit_rex(e, 0, src, 0, dst);
+    emit8(e, opcode);
+    emit8(e, modrm(3, src, dst));
+}
+
+// op r/m16, imm16 (add /0, and /4)
+static void emit_ri16(emitter *e, int ext, int dst, uint16_t imm)
+{
+    emit8(e, 0x66);
+    emit_rex(e, 0, 0, 0, dst);
+    emit8(e, 0x81);
+    emit8(e, modrm(3, ext, dst));
+    emit16(e, imm);
+}
+
+static void emit_not16(emitter *e, int dst)
+{
+    emit8(e, 0x66);
+    emit_rex(e, 0, 0, 0, dst);
+    emit8(e, 0xF7);
+    emit8(e, modrm(3, 2, dst));
+}
+
+static void emit_mov16_imm(emitter *e, int dst, uint16_t imm)
+{
+    emit8(e, 0x66);
+    emit_rex(e, 0, 0, 0, dst);
+    emit8(e, 0xB8 + (dst & 7));
+    emit16(e, imm);
+}
+
+// movzx/movsx r32, r16
+static void emit_movx32_r16(emitter *e, uint8_t opcode, int dst, int src)
+{
+    emit_rex(e, 0, dst, 0, src);
+    emit8(e, 0x0F);
+    emit8(e, opcode);
+    emit8(e, modrm(3, dst, src));
+}
+
+#define emit_movzx(e, dst, src) emit_movx32_r16(e, 0xB7, dst, src)
+#define emit_movsx(e, dst, src) emit_movx32_r16(e, 0xBF, dst, src)
+
+// Record r as the condition-code source
+static void emit_set_cc(emitter *e, int r)
+{
+    emit_movsx(e, RBX, r);
+}
+
+// mov r16, [rdi + disp32] (0x8B) or mov [rdi + disp32], r16 (0x89)
+static void emit_mem16_disp(emitter *e, uint8_t opcode, int r, int32_t disp)
+{
+    emit8(e, 0x66);
+    emit_rex(e, 0, r, 0, RDI);
+    emit8(e, opcode);
+    emit8(e, modrm(2, r, RDI));
+    emit32(e, disp);
+}
+
+// movzx r32, word [rdi + disp32]
+static void emit_movzx_disp(emitter *e, int r, int32_t disp)
+{
+    emit_rex(e, 0, r, 0, RDI);
+    emit8(e, 0x0F);
+    emit8(e, 0xB7);
+    emit8(e, modrm(2, r, RDI));
+    emit32(e, disp);
+}
+
+// mov r16, [rdi + rax*2] (0x8B) or mov [rdi + rax*2], r16 (0x89)
+static void emit_mem16_rax(emitter *e, uint8_t opcode, int r)
+{
+    emit8(e, 0x66);
+    emit_rex(e, 0, r, 0, RDI);
+    emit8(e, opcode);
+    emit8(e, modrm(0, r, 4));
+    emit8(e, (1 << 6) | (RAX << 3) | RDI);
+}
+
+// eax = (guest base + offset) & 0xFFFF
+static void emit_address(emitter *e, int base, uint16_t offset)
+{
+    emit_movzx(e, RAX, GUEST(base));
+    if (offset)
+    {
+        emit8(e, 0x66);
+        emit8(e, 0x05);
+        emit16(e, offset);
+    }
+}
+
+static void emit_mov_eax_imm(emitter *e, uint32_t imm)
+{
+    emit8(e, 0xB8);
+    emit32(e, imm);
+}
+
+// jmp rel32 to an already emitted target
+static void emit_jmp_to(emitter *e, const uint8_t *target)
+{
+    emit8(e, 0xE9);
+    emit32(e, (uint32_t)(target - (e->p + 4)));
+}
+
+static void emit_jcc_to(emitter *e, int cc, const uint8_t *target)
+{
+    emit8(e, 0x0F);
+    emit8(e, 0x80 + cc);
+    emit32(e, (uint32_t)(target - (e->p + 4)));
+}
+
+// Leave the block: eax = rdx + result, then jump to the shared epilogue
+static void emit_exit(emitter *e, const uint8_t *epilogue, uint32_t result)
+{
+    emit8(e, 0x8D);
+    emit8(e, modrm(2, RAX, RDX));
+    emit32(e, result);
+    emit_jmp_to(e, epilogue);
+}
+
+// Exit through a short forward jump that is skipped when cc holds
+static void emit_exit_unless(emitter *e, int cc, const uint8_t *epilogue, uint32_t result)
+{
+    emit8(e, 0x70 + cc);
+    emit8(e, 11);
+    emit_exit(e, epilogue, result);
+}
+
+static uint32_t exit_value(uint16_t pc, int retired)
+{
+    return pc | ((uint32_t)retired << 16);
+}
+
+// Guest accesses to the I/O page must go through mem_read/mem_write
+static void emit_io_check(emitter *e, const uint8_t *epilogue, uint16_t pc, int retired)
+{
+    emit8(e, 0x3D);
+    emit32(e, LC3_IO_BASE);
+    emit_exit_unless(e, 0x2 /* CC_B */, epilogue, exit_value(pc, retired));
+}
+
+// After a store to [eax]: mark its page dirty, drop its decode cache entry
+// and leave the block if the word belonged to translated code
+static void emit_store_fixup(emitter *e, const uint8_t *epilogue, uint16_t next, int retired)
+{
+    // mov ecx, eax; shr ecx, LC3_PAGE_SHIFT; mov byte [rdi + rcx + dirty], LC3_DIRTY_ALL
+    emit8(e, 0x89);
+    emit8(e, modrm(3, RAX, RCX));
+    emit8(e, 0xC1);
+    emit8(e, modrm(3, 5, RCX));
+    emit8(e, LC3_PAGE_SHIFT);
+    emit8(e, 0xC6);
+    emit8(e, modrm(2, 0, 4));
+    emit8(e, (RCX << 3) | RDI);
+    emit32(e, DIRTY_DISP);
+    emit8(e, LC3_DIRTY_ALL);
+
+    // mov ecx, eax; shl ecx, 4; mov qword [rsi + rcx], 0
+    emit8(e, 0x89);
+    emit8(e, modrm(3, RAX, RCX));
+    emit8(e, 0xC1);
+    emit8(e, modrm(3, 4, RCX));
+    emit8(e, 4);
+    emit8(e, 0x48);
+    emit8(e, 0xC7);
+    emit8(e, modrm(0, 0, 4));
+    emit8(e, (RCX << 3) | RSI);
+    emit32(e, 0);
+
+    // The entry before may hold a fused pair ending here:
+    // lea ecx, [rax - 1]; and ecx, 0xFFFF; shl ecx, 4; mov qword [rsi + rcx], 0
+    emit8(e, 0x8D);
+    emit8(e, modrm(1, RCX, RAX));
+    emit8(e, 0xFF);
+    emit8(e, 0x81);
+    emit8(e, modrm(3, 4, RCX));
+    emit32(e, 0xFFFF);
+    emit8(e, 0xC1);
+    emit8(e, modrm(3, 4, RCX));
+    emit8(e, 4);
+    emit8(e, 0x48);
+    emit8(e, 0xC7);
+    emit8(e, modrm(0, 0, 4));
+    emit8(e, (RCX << 3) | RSI);
+    emit32(e, 0);
+
+    // cmp byte [rbp + rax], 0
+    emit8(e, 0x80);
+    emit8(e, modrm(1, 7, 4));
+    emit8(e, (RAX << 3) | RBP);
+    emit8(e, 0);
+    emit8(e, 0);
+    emit_exit_unless(e, CC_E, epilogue, exit_value(next, retired) | LC3_JIT_CODE_WRITE);
+}
+
+static void emit_epilogue(emitter *e)
+{
+    for (int r = R_R0; r <= R_R7; ++r)
+        emit_mem16_disp(e, 0x89, GUEST(r), REG_DISP(r));
+
+    // mov [rdi + cc], bx
+    emit_mem16_disp(e, 0x89, RBX, CC_DISP);
+
+    emit8(e, 0x41);
+    emit8(e, 0x5F);
+    emit8(e, 0x41);
+    emit8(e, 0x5E);
+    emit8(e, 0x41);
+    emit8(e, 0x5D);
+    emit8(e, 0x41);
+    emit8(e, 0x5C);
+    emit8(e, 0x5D);
+    emit8(e, 0x5B);
+    emit8(e, 0xC3);
+}
+
+static void emit_prologue(emitter *e, struct lc3_jit *jit)
+{
+    // push rbx, rbp, r12-r15
+    emit8(e, 0x53);
+    emit8(e, 0x55);
+    emit8(e, 0x41);
+    emit8(e, 0x54);
+    emit8(e, 0x41);
+    emit8(e, 0x55);
+    emit8(e, 0x41);
+    emit8(e, 0x56);
+    emit8(e, 0x41);
+    emit8(e, 0x57);
+
+    // mov rsi, [rdi + decoded]
+    emit8(e, 0x48);
+    emit8(e, 0x8B);
+    emit8(e, modrm(2, RSI, RDI));
+    emit32(e, offsetof(lc3_vm, decoded));
+
+    // movabs rbp, code_map
+    emit8(e, 0x48);
+    emit8(e, 0xB8 + RBP);
+    uint64_t map = (uint64_t)(uintptr_t)jit->code_map;
+    emit32(e, (uint32_t)map);
+    emit32(e, (uint32_t)(map >> 32));
+
+    for (int r = R_R0; r <= R_R7; ++r)
+        emit_movzx_disp(e, GUEST(r), REG_DISP(r));
+
+    // movsx ebx, word [rdi + cc]
+    emit8(e, 0x0F);
+    emit8(e, 0xBF);
+    emit8(e, modrm(2, RBX, RDI));
+    emit32(e, CC_DISP);
+
+    // xor edx, edx
+    emit8(e, 0x31);
+    emit8(e, modrm(3, RDX, RDX));
+}
+
+// Condition under which BR with the given nzp mask is taken
+static int branch_cc(int nzp)
+{
+    switch (nzp)
+    {
+    case FL_NEG:
+        return CC_L;
+    case FL_ZRO:
+        return CC_E;
+    case FL_POS:
+        return CC_G;
+    case FL_NEG | FL_ZRO:
+        return CC_LE;
+    case FL_NEG | FL_POS:
+        return CC_NE;
+    default:
+        return CC_GE;
+    }
+}
+
+// Translate the block starting at start; returns NULL if nothing could be compiled
+static lc3_jit_block compile(lc3_vm *vm, struct lc3_jit *jit, uint16_t start)
+{
+    emitter em = {jit->buffer + jit->used, jit->buffer + LC3_JIT_BUFFER_SIZE, 0};
+    emitter *e = &em;
+    const uint16_t *memory = vm->memory;
+
+    uint8_t *epilogue = e->p;
+    emit_epilogue(e);
+    uint8_t *entry = e->p;
+    emit_prologue(e, jit);
+    uint8_t *body = e->p;
+
+    uint16_t pc = start;
+    int n = 0;
+    int stop = 0;  // next instruction must run in the interpreter
+    int ended = 0; // last instruction always leaves the block
+
+    while (!stop && !ended && n < LC3_JIT_MAX_BLOCK && pc < LC3_IO_BASE)
+    {
+        uint16_t instr = memory[pc];
+        uint16_t next = pc + 1;
+        int dr = (instr >> 9) & 0x7;
+        int sr1 = (instr >> 6) & 0x7;
+        uint16_t pc_target = next + sign_extend(instr & 0x1FF, 9);
+
+        switch (instr >> 12)
+        {
+        case OP_ADD:
+        case OP_AND:
+        {
+            uint8_t opcode = (instr >> 12) == OP_ADD ? 0x01 : 0x21;
+            if (instr & 0x20)
+            {
+                uint16_t imm = sign_extend(instr & 0x1F, 5);
+                if (dr != sr1)
+                    emit_rr16(e, 0x89, GUEST(dr), GUEST(sr1));
+                emit_ri16(e, opcode == 0x01 ? 0 : 4, GUEST(dr), imm);
+            }
+            else
+            {
+                int sr2 = instr & 0x7;
+                if (dr == sr2)
+                {
+                    emit_rr16(e, opcode, GUEST(dr), GUEST(sr1));
+                }
+                else
+                {
+                    if (dr != sr1)
+                        emit_rr16(e, 0x89, GUEST(dr), GUEST(sr1));
+                    emit_rr16(e, opcode, GUEST(dr), GUEST(sr2));
+                }
+            }
+            emit_set_cc(e, GUEST(dr));
+            break;
+        }
+        case OP_NOT:
+            if (dr != sr1)
+                emit_rr16(e, 0x89, GUEST(dr), GUEST(sr1));
+            emit_not16(e, GUEST(dr));
+            emit_set_cc(e, GUEST(dr));
+            break;
+        case OP_LEA:
+            emit_mov16_imm(e, GUEST(dr), pc_target);
+            emit_set_cc(e, GUEST(dr));
+            break;
+        case OP_LD:
+            if (pc_target >= LC3_IO_BASE)
+            {
+                stop = 1;
+                continue;
+            }
+            emit_mem16_disp(e, 0x8B, GUEST(dr), MEM_DISP(pc_target));
+            emit_set_cc(e, GUEST(dr));
+            break;
+        case OP_LDI:
+            if (pc_target >= LC3_IO_BASE)
+            {
+                stop = 1;
+                continue;
+            }
+            emit_movzx_disp(e, RAX, MEM_DISP(pc_target));
+            emit_io_check(e, epilogue, pc, n);
+            emit_mem16_rax(e, 0x8B, GUEST(dr));
+            emit_set_cc(e, GUEST(dr));
+            break;
+        case OP_LDR:
+            emit_address(e, sr1, sign_extend(instr & 0x3F, 6));
+            emit_io_check(e, epilogue, pc, n);
+            emit_mem16_rax(e, 0x8B, GUEST(dr));
+            emit_set_cc(e, GUEST(dr));
+            break;
+        case OP_ST:
+            if (pc_target >= LC3_IO_BASE)
+            {
+                stop = 1;
+                continue;
+            }
+            emit_mov_eax_imm(e, pc_target);
+            emit_mem16_rax(e, 0x89, GUEST(dr));
+            emit_store_fixup(e, epilogue, next, n + 1);
+            break;
+        case OP_STI:
+            if (pc_target >= LC3_IO_BASE)
+            {
+                stop = 1;
+                continue;
+            }
+            emit_movzx_disp(e, RAX, MEM_DISP(pc_target));
+            emit_io_check(e, epilogue, pc, n);
+            emit_mem16_rax(e, 0x89, GUEST(dr));
+            emit_store_fixup(e, epilogue, next, n + 1);
+            break;
+        case OP_STR:
+            emit_address(e, sr1, sign_extend(instr & 0x3F, 6));
+            emit_io_check(e, epilogue, pc, n);
+            emit_mem16_rax(e, 0x89, GUEST(dr));
+            emit_store_fixup(e, epilogue, next, n + 1);
+            break;
+        case OP_BR:
+        {
+            int nzp = dr;
+            if (!nzp)
+                break;
+            if (nzp != 7)
+            {
+                // Skip the taken path when the condition does not hold
+                emit8(e, 0x85);
+                emit8(e, modrm(3, RBX, RBX));
+                emit8(e, 0x70 + (branch_cc(nzp) ^ 1));
+            }
+            uint8_t *skip = e->p;
+            if (nzp != 7)
+                emit8(e, 0);
+            if (pc_target == start)
+            {
+                // Self-loop: stay native until the retired count reaches
+                // loop_limit; cmp edx, [rbp + loop_limit]
+                emit8(e, 0x81);
+                emit8(e, modrm(3, 0, RDX));
+                emit32(e, (uint32_t)(n + 1) << 16);
+                emit8(e, 0x3B);
+                emit8(e, modrm(2, RDX, RBP));
+                emit32(e, LOOP_LIMIT_DISP);
+                emit_jcc_to(e, 0x2 /* CC_B */, body);
+                emit_exit(e, epilogue, start);
+            }
+            else
+            {
+                emit_exit(e, epilogue, exit_value(pc_target, n + 1));
+            }
+            // After an overflow skip points past the buffer; the block is
+            // thrown away below
+            if (nzp == 7)
+                ended = 1;
+            else if (!e->overflow)
+                *skip = (uint8_t)(e->p - skip - 1);
+            break;
+        }
+        case OP_JMP:
+            emit_movzx(e, RAX, GUEST(sr1));
+            emit8(e, 0x01);
+            emit8(e, modrm(3, RDX, RAX));
+            emit8(e, 0x05);
+            emit32(e, exit_value(0, n + 1));
+            emit_jmp_to(e, epilogue);
+            ended = 1;
+            break;
+        case OP_JSR:
+            if (instr & 0x800)
+            {
+                emit_mov16_imm(e, GUEST(R_R7), next);
+                emit_exit(e, epilogue, exit_value(next + sign_extend(instr & 0x7FF, 11), n + 1));
+            }
+            else
+            {
+                emit_movzx(e, RAX, GUEST(sr1));
+                emit_mov16_imm(e, GUEST(R_R7), next);
+                emit8(e, 0x01);
+                emit8(e, modrm(3, RDX, RAX));
+                emit8(e, 0x05);
+                emit32(e, exit_value(0, n + 1));
+                emit_jmp_to(e, epilogue);
+            }
+            ended = 1;
+            break;
+        default:
+            // TRAP, RTI and reserved opcodes are left to the interpreter
+            stop = 1;
+            continue;
+        }
+
+        pc = next;
+        n++;
+    }
+
+    if (!ended)
+        emit_exit(e, epilogue, exit_value(pc, n));
+
+    if (n == 0)
+        return NULL;
+
+    if (e->overflow)
+    {
+        // Out of space: start over with an empty buffer
+        lc3_jit_flush(jit);
+        return NULL;
+    }
+
+    for (uint16_t a = start; a != pc; ++a)
+        jit->code_map[a] = 1;
+    jit->used = e->p - jit->buffer;
+    jit->blocks[start] = (lc3_jit_block)(void *)entry;
+    return jit->blocks[start];
+}
+
+struct lc3_jit *lc3_jit_create(void)
+{
+    struct lc3_jit *jit = calloc(1, sizeof(*jit));
+    if (!jit)
+    {
+        return NULL;
+    }
+
+    jit->buffer = mmap(NULL, LC3_JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buffer == MAP_FAILED)
+    {
+        free(jit);
+        return NULL;
+    }
+    return jit;
+}
+
+// Make the buffer writable for emitting, or executable for running
+static int set_writable(struct lc3_jit *jit, int writable)
+{
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+    return mprotect(jit->buffer, LC3_JIT_BUFFER_SIZE, prot) == 0;
+}
+
+void lc3_jit_destroy(struct lc3_jit *jit)
+{
+    if (!jit)
+    {
+        return;
+    }
+    munmap(jit->buffer, LC3_JIT_BUFFER_SIZE);
+    free(jit);
+}
+
+void lc3_jit_flush(struct lc3_jit *jit)
+{
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->hits, 0, sizeof(jit->hits));
+    memset(jit->code_map, 0, sizeof(jit->code_map));
+    jit->used = 0;
+}
+
+void lc3_jit_invalidate(struct lc3_jit *jit, uint16_t address)
+{
+    if (jit->code_map[address])
+    {
+        lc3_jit_flush(jit);
+    }
+}
+
+// Run translated blocks from the current PC for as long as they chain into
+// each other, or until about budget instructions have retired (a block is
+// never cut short). Returns the number of guest instructions retired natively.
+uint64_t lc3_jit_run(lc3_vm *vm, uint64_t budget)
+{
+    struct lc3_jit *jit = vm->jit;
+    uint64_t retired = 0;
+
+    for (;;)
+    {
+        uint16_t pc = vm->reg[R_PC];
+        lc3_jit_block block = jit->blocks[pc];
+
+        if (!block)
+        {
+            if (pc >= LC3_IO_BASE || jit->hits[pc] == LC3_JIT_NEVER)
+                return retired;
+            if (++jit->hits[pc] < LC3_JIT_THRESHOLD)
+                return retired;
+            block = set_writable(jit, 1) ? compile(vm, jit, pc) : NULL;
+            if (!set_writable(jit, 0))
+            {
+                // Nothing in the buffer can run; leave it all to the interpreter
+                lc3_jit_flush(jit);
+                return retired;
+            }
+            if (!block)
+            {
+                jit->hits[pc] = LC3_JIT_NEVER;
+                return retired;
+            }
+        }
+
+        // Self-loops stop near the budget rather than running it far over
+        uint64_t left = budget - retired;
+        if (left > LC3_JIT_MAX_RETIRED - LC3_JIT_MAX_BLOCK)
+            left = LC3_JIT_MAX_RETIRED - LC3_JIT_MAX_BLOCK;
+        jit->loop_limit = (uint32_t)left << 16;
+
+        uint32_t result = block(vm);
+        uint32_t block_retired = (result >> 16) & LC3_JIT_MAX_RETIRED;
+        vm->reg[R_PC] = result & 0xFFFF;
+        retired += block_retired;
+
+        if (result & LC3_JIT_CODE_WRITE)
+            lc3_jit_flush(jit);
+
+        // A block that bailed out on its first instruction (I/O access)
+        // leaves that instruction to the interpreter
+        if (!block_retired || retired >= budget || lc3_interrupted())
+            return retired;
+    }
+}
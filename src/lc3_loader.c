@@ -0,0 +1,301 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "lc3.h"
+
+// Image loading. Two formats are accepted, both big-endian:
+//
+// Plain object file: one origin word followed by the words to place there.
+//
+// Multi-segment container:
+//   char     magic[4]        "LC3M"
+//   uint16   version         1
+//   uint16   segment_count
+//   uint16   entry           initial PC
+//   uint16   reserved        0
+//   uint32   checksum        Fletcher-32 over every word after the header
+//   segment_count times:
+//     uint16 origin
+//     uint16 length          in words, at least 1
+//     uint16 words[length]
+// Segments must fit below 0x10000 without wrapping and must not overlap.
+// The whole file is validated before any memory is written.
+
+#define CONTAINER_HEADER_SIZE 16
+#define STREAM_MAX_SIZE (1 << 20) // larger than any valid image
+#define CONTAINER_VERSION 1
+
+static uint16_t read_be16(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t read_be32(const uint8_t *p)
+{
+    return ((uint32_t)read_be16(p) << 16) | read_be16(p + 2);
+}
+
+// Copy count big-endian words from src (any alignment) into dst
+void lc3_copy_be16(uint16_t *dst, const uint8_t *src, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 2));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, swap));
+    }
+#elif defined(__SSSE3__)
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, swap));
+    }
+#elif defined(__SSE2__)
+    // No pshufb on baseline x86-64: swap bytes with two shifts and an or
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        dst[i] = read_be16(src + i * 2);
+    }
+}
+
+// Fletcher-32 over big-endian 16-bit words
+static uint32_t fletcher32(const uint8_t *data, size_t words)
+{
+    uint32_t sum1 = 0xFFFF, sum2 = 0xFFFF;
+
+    while (words)
+    {
+        // 359 words is the most that cannot overflow 32-bit sums
+        size_t block = words > 359 ? 359 : words;
+        words -= block;
+        do
+        {
+            sum1 += read_be16(data);
+            sum2 += sum1;
+            data += 2;
+        } while (--block);
+        sum1 = (sum1 & 0xFFFF) + (sum1 >> 16);
+        sum2 = (sum2 & 0xFFFF) + (sum2 >> 16);
+    }
+
+    sum1 = (sum1 & 0xFFFF) + (sum1 >> 16);
+    sum2 = (sum2 & 0xFFFF) + (sum2 >> 16);
+    return (sum2 << 16) | sum1;
+}
+
+static int load_object(lc3_vm *vm, const uint8_t *data, size_t size)
+{
+    if (size < 2)
+    {
+        return 0;
+    }
+
+    uint16_t origin = read_be16(data);
+    size_t count = (size - 2) / 2;
+    size_t max_count = MEMORY_MAX - (size_t)origin;
+    if (count > max_count)
+    {
+        count = max_count;
+    }
+
+    lc3_mem_load_be16(vm, origin, data + 2, count);
+    return 1;
+}
+
+static int load_container(lc3_vm *vm, const uint8_t *data, size_t size)
+{
+    if (size < CONTAINER_HEADER_SIZE || (size - CONTAINER_HEADER_SIZE) % 2 != 0)
+    {
+        return 0;
+    }
+
+    uint16_t version = read_be16(data + 4);
+    uint16_t segment_count = read_be16(data + 6);
+    uint16_t entry = read_be16(data + 8);
+    uint32_t checksum = read_be32(data + 12);
+    const uint8_t *body = data + CONTAINER_HEADER_SIZE;
+    size_t body_words = (size - CONTAINER_HEADER_SIZE) / 2;
+
+    if (version != CONTAINER_VERSION || read_be16(data + 10) != 0 || segment_count == 0)
+    {
+        return 0;
+    }
+    if (fletcher32(body, body_words) != checksum)
+    {
+        return 0;
+    }
+
+    // First pass: bounds and overlap checks
+    uint8_t used[MEMORY_MAX / 8];
+    memset(used, 0, sizeof(used));
+    size_t pos = 0;
+    for (uint16_t s = 0; s < segment_count; ++s)
+    {
+        if (body_words - pos < 2)
+        {
+            return 0;
+        }
+        size_t origin = read_be16(body + pos * 2);
+        size_t length = read_be16(body + pos * 2 + 2);
+        pos += 2;
+        if (length == 0 || length > body_words - pos || origin + length > MEMORY_MAX)
+        {
+            return 0;
+        }
+        for (size_t a = origin; a < origin + length; ++a)
+        {
+            if (used[a >> 3] & (1 << (a & 7)))
+            {
+                return 0;
+            }
+            used[a >> 3] |= 1 << (a & 7);
+        }
+        pos += length;
+    }
+    if (pos != body_words)
+    {
+        return 0;
+    }
+
+    // Second pass: copy
+    pos = 0;
+    for (uint16_t s = 0; s < segment_count; ++s)
+    {
+        uint16_t origin = read_be16(body + pos * 2);
+        uint16_t length = read_be16(body + pos * 2 + 2);
+        pos += 2;
+        lc3_mem_load_be16(vm, origin, body + pos * 2, length);
+        pos += length;
+    }
+
+    vm->reg[R_PC] = entry;
+    return 1;
+}
+
+int lc3_load_buffer(lc3_vm *vm, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    int ok;
+
+    if (size >= 4 && memcmp(bytes, "LC3M", 4) == 0)
+    {
+        ok = load_container(vm, bytes, size);
+    }
+    else
+    {
+        ok = load_object(vm, bytes, size);
+    }
+
+    if (ok)
+    {
+        // Memory no longer matches any snapshot; lc3_mem_load_be16 has
+        // marked the pages it wrote and dropped their decoded code
+        vm->snapshot_id = 0;
+    }
+    return ok;
+}
+
+// Read a pipe or other stream that cannot be mapped, up to its end or
+// STREAM_MAX_SIZE bytes: past that, an object file is cut short by
+// load_object anyway and no container is valid. NULL if reading fails.
+static char *read_stream(int fd, size_t *size)
+{
+    size_t cap = 4096, len = 0;
+    char *buf = malloc(cap);
+
+    while (buf)
+    {
+        if (len == cap)
+        {
+            if (cap == STREAM_MAX_SIZE)
+                break;
+            char *grown = realloc(buf, cap * 2);
+            if (!grown)
+            {
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            free(buf);
+            return NULL;
+        }
+        if (n == 0)
+            break;
+        len += (size_t)n;
+    }
+    *size = len;
+    return buf;
+}
+
+int lc3_load_image(lc3_vm *vm, const char *image_path)
+{
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        // Pipes, FIFOs and process substitution are read instead of mapped
+        size_t size;
+        char *bytes = read_stream(fd, &size);
+        close(fd);
+        if (!bytes)
+        {
+            return 0;
+        }
+        int ok = lc3_load_buffer(vm, bytes, size);
+        free(bytes);
+        return ok;
+    }
+    if (st.st_size < 2)
+    {
+        close(fd);
+        return 0;
+    }
+
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    int ok = lc3_load_buffer(vm, data, (size_t)st.st_size);
+    munmap(data, (size_t)st.st_size);
+    return ok;
+}
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lc3.h"
+
+// Guest memory access.
+//
+// mem_read and mem_write are the guest's loads and stores: they go through
+// the device bus for the I/O page and keep the decoded instructions, JIT
+// and dirty pages in step with memory.
+//
+// The block functions move whole ranges for the host side (loaders, the
+// output traps, debuggers). Addresses wrap from 0xFFFF to 0x0000, devices
+// are bypassed, and each range is split into runs that do not wrap so the
+// copies and scans inside a run are plain loops over memory.
+
+// Fixed-size blocks with no early exit, so the compiler can vectorize them
+#define SCAN_BLOCK 16
+
+// Forget anything decoded or translated from address
+static void invalidate_word(lc3_vm *vm, uint16_t address)
+{
+    if (vm->decoded)
+    {
+        // The word before may be fused with this one
+        vm->decoded[address].handler = NULL;
+        vm->decoded[(uint16_t)(address - 1)].handler = NULL;
+    }
+#ifdef LC3_JIT
+    if (vm->jit)
+    {
+        lc3_jit_invalidate(vm->jit, address);
+    }
+#endif
+}
+
+// Bookkeeping after count words from address (not wrapping) changed
+static void written(lc3_vm *vm, uint16_t address, size_t count)
+{
+    size_t last = address + count - 1;
+    for (size_t page = address >> LC3_PAGE_SHIFT; page <= last >> LC3_PAGE_SHIFT; ++page)
+    {
+        vm->dirty[page] = LC3_DIRTY_ALL;
+    }
+    if (!vm->decoded && !vm->jit)
+    {
+        return;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        invalidate_word(vm, (uint16_t)(address + i));
+    }
+}
+
+void mem_write(lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    if (vm->tracer)
+    {
+        lc3_trace_store(vm, address, val);
+    }
+    if (lc3_is_device(vm, address) && lc3_bus_write(vm, address, val))
+    {
+        return;
+    }
+    vm->memory[address] = val;
+    lc3_mark_dirty(vm, address);
+    invalidate_word(vm, address);
+}
+
+uint16_t mem_read(lc3_vm *vm, uint16_t address)
+{
+    if (lc3_is_device(vm, address))
+    {
+        return lc3_bus_read(vm, address);
+    }
+    return vm->memory[address];
+}
+
+// Drop every pre-decoded or translated instruction after memory changed
+// behind mem_write
+void lc3_invalidate_decoded(lc3_vm *vm)
+{
+    free(vm->decoded);
+    vm->decoded = NULL;
+#ifdef LC3_JIT
+    if (vm->jit)
+    {
+        lc3_jit_flush(vm->jit);
+    }
+#endif
+}
+
+void lc3_mem_read_block(const lc3_vm *vm, uint16_t address, uint16_t *dst, size_t count)
+{
+    while (count)
+    {
+        size_t run = lc3_mem_run(address, count);
+        memcpy(dst, vm->memory + address, run * sizeof(uint16_t));
+        dst += run;
+        count -= run;
+        address = (uint16_t)(address + run);
+    }
+}
+
+void lc3_mem_write_block(lc3_vm *vm, uint16_t address, const uint16_t *src, size_t count)
+{
+    while (count)
+    {
+        size_t run = lc3_mem_run(address, count);
+        memcpy(vm->memory + address, src, run * sizeof(uint16_t));
+        written(vm, address, run);
+        src += run;
+        count -= run;
+        address = (uint16_t)(address + run);
+    }
+}
+
+// lc3_mem_write_block from big-endian words (any alignment), as stored in
+// image files
+void lc3_mem_load_be16(lc3_vm *vm, uint16_t address, const uint8_t *src, size_t count)
+{
+    while (count)
+    {
+        size_t run = lc3_mem_run(address, count);
+        lc3_copy_be16(vm->memory + address, src, run);
+        written(vm, address, run);
+        src += run * 2;
+        count -= run;
+        address = (uint16_t)(address + run);
+    }
+}
+
+// Number of nonzero words from address up to the first zero word, looking
+// at no more than limit words
+size_t lc3_mem_scan(const lc3_vm *vm, uint16_t address, size_t limit)
+{
+    size_t done = 0;
+
+    while (done < limit)
+    {
+        uint16_t start = (uint16_t)(address + done);
+        size_t run = lc3_mem_run(start, limit - done);
+        const uint16_t *p = vm->memory + start;
+        size_t i = 0;
+
+        for (; i + SCAN_BLOCK <= run; i += SCAN_BLOCK)
+        {
+            int zero = 0;
+            for (int j = 0; j < SCAN_BLOCK; ++j)
+            {
+                zero |= p[i + j] == 0;
+            }
+            if (zero)
+                break;
+        }
+        while (i < run && p[i])
+        {
+            ++i;
+        }
+
+        done += i;
+        if (i < run)
+            break;
+    }
+    return done;
+}
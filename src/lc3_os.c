@@ -0,0 +1,418 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "lc3.h"
+
+// Guest-OS trap mode. With an OS attached, TRAP saves the return address in
+// R7 and continues at the routine the vector table (x0000-x00FF) names, as
+// the OS image in memory defines it. A routine identical to one of the
+// built-in OS (lc3_os_install) runs natively instead: the whole routine is
+// hashed and compared with those. There is no native path for any other OS
+// image; its routines always run as guest code.
+//
+// A routine is every instruction reachable from its entry, following both
+// ways out of conditional branches and ending at RET and RTI. Its hash
+// covers each instruction with its offset from the entry, and the data it
+// depends on: the word an LD reads (unless the routine also stores there,
+// as with register save slots), the pointer behind an LDI or STI, the
+// string a LEA points to, and the routine of each TRAP it calls. A routine
+// that uses JSR, JSRR or JMP is never matched.
+//
+// Resolved routines are cached per vector. Only routines entirely in system
+// space (below LC3_USER_BASE) are matched, so a write to any system page,
+// seen through LC3_DIRTY_OS, is all that drops the cache.
+
+#define OS_BASE 0x0200      // built-in OS routines and their data
+#define OS_MAX_ROUTINE 128  // instructions hashed at most
+#define OS_MAX_STRING 256   // words of a LEA string hashed at most
+#define OS_MAX_NESTING 4    // TRAPs within TRAPs followed at most
+
+enum
+{
+    OS_UNRESOLVED = 0,
+    OS_RESOLVED = 1
+};
+
+struct lc3_os
+{
+    uint8_t state[256];
+    int16_t routine[256]; // what lc3_os_native returns for the vector
+};
+
+typedef struct
+{
+    uint64_t hash;
+    int routine;
+} builtin_routine;
+
+static builtin_routine builtin[7];
+static int builtin_count;
+static pthread_once_t builtin_once = PTHREAD_ONCE_INIT;
+
+static uint16_t pcrel(int op, int r, uint16_t pc, uint16_t target)
+{
+    return (uint16_t)((op << 12) | (r << 9) | ((target - (pc + 1)) & 0x1FF));
+}
+
+static uint16_t add_imm(int dr, int sr, int imm)
+{
+    return (uint16_t)((OP_ADD << 12) | (dr << 9) | (sr << 6) | 0x20 | (imm & 0x1F));
+}
+
+static uint16_t add_reg(int dr, int sr1, int sr2)
+{
+    return (uint16_t)((OP_ADD << 12) | (dr << 9) | (sr1 << 6) | sr2);
+}
+
+static uint16_t and_imm(int dr, int sr, int imm)
+{
+    return (uint16_t)((OP_AND << 12) | (dr << 9) | (sr << 6) | 0x20 | (imm & 0x1F));
+}
+
+static uint16_t and_reg(int dr, int sr1, int sr2)
+{
+    return (uint16_t)((OP_AND << 12) | (dr << 9) | (sr1 << 6) | sr2);
+}
+
+static uint16_t ldr(int dr, int base, int offset)
+{
+    return (uint16_t)((OP_LDR << 12) | (dr << 9) | (base << 6) | (offset & 0x3F));
+}
+
+#define RET_WORD ((OP_JMP << 12) | (R_R7 << 6))
+#define TRAP_WORD(vector) ((OP_TRAP << 12) | (vector))
+#define EMIT(word) (m[pc] = (word), pc++)
+
+static uint16_t put_string(uint16_t *m, uint16_t pc, const char *s)
+{
+    while (*s)
+    {
+        m[pc++] = (unsigned char)*s++;
+    }
+    m[pc++] = 0;
+    return pc;
+}
+
+// Wait for DSR, then write R0 to DDR; R1 is clobbered
+static uint16_t emit_putc(uint16_t *m, uint16_t pc, uint16_t dsr, uint16_t ddr)
+{
+    uint16_t wait = pc;
+    EMIT(pcrel(OP_LDI, R_R1, pc, dsr));
+    EMIT(pcrel(OP_BR, FL_ZRO | FL_POS, pc, wait));
+    EMIT(pcrel(OP_STI, R_R0, pc, ddr));
+    return pc;
+}
+
+// Write the built-in OS into m: the vector table, then data and routines
+// from OS_BASE. The routines drive the devices the way the native traps do
+// and produce the same output.
+static void build_os(uint16_t *m)
+{
+    uint16_t pc = OS_BASE;
+
+    const uint16_t kbsr = pc++, kbdr = pc++, dsr = pc++, ddr = pc++, mcr = pc++;
+    const uint16_t run_mask = pc++, low_mask = pc++;
+    const uint16_t save = pc; // R0-R7
+    pc += 8;
+    m[kbsr] = MR_KBSR;
+    m[kbdr] = MR_KBDR;
+    m[dsr] = MR_DSR;
+    m[ddr] = MR_DDR;
+    m[mcr] = MR_MCR;
+    m[run_mask] = 0x7FFF;
+    m[low_mask] = 0x00FF;
+    const uint16_t prompt = pc;
+    pc = put_string(m, pc, "Enter a character: ");
+    const uint16_t halt_msg = pc;
+    pc = put_string(m, pc, "HALT\n");
+    const uint16_t bad_msg = pc;
+    pc = put_string(m, pc, "Unknown trap\n");
+
+    // GETC: poll KBSR, then read KBDR
+    m[TRAP_GETC] = pc;
+    EMIT(pcrel(OP_LDI, R_R0, pc, kbsr));
+    EMIT(pcrel(OP_BR, FL_ZRO | FL_POS, pc, m[TRAP_GETC]));
+    EMIT(pcrel(OP_LDI, R_R0, pc, kbdr));
+    EMIT(RET_WORD);
+
+    // OUT
+    m[TRAP_OUT] = pc;
+    EMIT(pcrel(OP_ST, R_R1, pc, save + 1));
+    pc = emit_putc(m, pc, dsr, ddr);
+    EMIT(pcrel(OP_LD, R_R1, pc, save + 1));
+    EMIT(RET_WORD);
+
+    // PUTS: one character per word until a zero word
+    m[TRAP_PUTS] = pc;
+    EMIT(pcrel(OP_ST, R_R0, pc, save));
+    EMIT(pcrel(OP_ST, R_R1, pc, save + 1));
+    EMIT(pcrel(OP_ST, R_R2, pc, save + 2));
+    EMIT(add_imm(R_R2, R_R0, 0));
+    uint16_t puts_loop = pc;
+    EMIT(ldr(R_R0, R_R2, 0));
+    uint16_t puts_end = pc++;
+    pc = emit_putc(m, pc, dsr, ddr);
+    EMIT(add_imm(R_R2, R_R2, 1));
+    EMIT(pcrel(OP_BR, FL_NEG | FL_ZRO | FL_POS, pc, puts_loop));
+    m[puts_end] = pcrel(OP_BR, FL_ZRO, puts_end, pc);
+    EMIT(pcrel(OP_LD, R_R0, pc, save));
+    EMIT(pcrel(OP_LD, R_R1, pc, save + 1));
+    EMIT(pcrel(OP_LD, R_R2, pc, save + 2));
+    EMIT(RET_WORD);
+
+    // IN: prompt, read a character and echo it
+    m[TRAP_IN] = pc;
+    EMIT(pcrel(OP_ST, R_R7, pc, save + 7));
+    EMIT(pcrel(OP_LEA, R_R0, pc, prompt));
+    EMIT(TRAP_WORD(TRAP_PUTS));
+    EMIT(TRAP_WORD(TRAP_GETC));
+    EMIT(TRAP_WORD(TRAP_OUT));
+    EMIT(pcrel(OP_LD, R_R7, pc, save + 7));
+    EMIT(add_imm(R_R0, R_R0, 0));
+    EMIT(RET_WORD);
+
+    // PUTSP: two characters per word, low byte first; a zero high byte is
+    // skipped. The high byte is shifted down one bit at a time.
+    m[TRAP_PUTSP] = pc;
+    for (int r = R_R0; r <= R_R4; ++r)
+        EMIT(pcrel(OP_ST, r, pc, save + r));
+    EMIT(add_imm(R_R2, R_R0, 0));
+    uint16_t putsp_loop = pc;
+    EMIT(ldr(R_R3, R_R2, 0));
+    uint16_t putsp_end = pc++;
+    EMIT(pcrel(OP_LD, R_R4, pc, low_mask));
+    EMIT(and_reg(R_R0, R_R3, R_R4));
+    pc = emit_putc(m, pc, dsr, ddr);
+    EMIT(and_imm(R_R0, R_R0, 0));
+    EMIT(and_imm(R_R4, R_R4, 0));
+    EMIT(add_imm(R_R4, R_R4, 8));
+    uint16_t shift = pc;
+    EMIT(add_reg(R_R0, R_R0, R_R0));
+    EMIT(add_imm(R_R3, R_R3, 0));
+    EMIT(pcrel(OP_BR, FL_ZRO | FL_POS, pc, pc + 2));
+    EMIT(add_imm(R_R0, R_R0, 1));
+    EMIT(add_reg(R_R3, R_R3, R_R3));
+    EMIT(add_imm(R_R4, R_R4, -1));
+    EMIT(pcrel(OP_BR, FL_POS, pc, shift));
+    EMIT(add_imm(R_R0, R_R0, 0));
+    EMIT(pcrel(OP_BR, FL_ZRO, pc, pc + 4));
+    pc = emit_putc(m, pc, dsr, ddr);
+    EMIT(add_imm(R_R2, R_R2, 1));
+    EMIT(pcrel(OP_BR, FL_NEG | FL_ZRO | FL_POS, pc, putsp_loop));
+    m[putsp_end] = pcrel(OP_BR, FL_ZRO, putsp_end, pc);
+    for (int r = R_R0; r <= R_R4; ++r)
+        EMIT(pcrel(OP_LD, r, pc, save + r));
+    EMIT(RET_WORD);
+
+    // HALT: say so, then clear the MCR run bit
+    m[TRAP_HALT] = pc;
+    EMIT(pcrel(OP_LEA, R_R0, pc, halt_msg));
+    EMIT(TRAP_WORD(TRAP_PUTS));
+    uint16_t stop = pc;
+    EMIT(pcrel(OP_LDI, R_R1, pc, mcr));
+    EMIT(pcrel(OP_LD, R_R2, pc, run_mask));
+    EMIT(and_reg(R_R1, R_R1, R_R2));
+    EMIT(pcrel(OP_STI, R_R1, pc, mcr));
+    EMIT(pcrel(OP_BR, FL_NEG | FL_ZRO | FL_POS, pc, stop));
+
+    // Every other vector
+    uint16_t bad = pc;
+    EMIT(pcrel(OP_LEA, R_R0, pc, bad_msg));
+    EMIT(TRAP_WORD(TRAP_PUTS));
+    EMIT(pcrel(OP_BR, FL_NEG | FL_ZRO | FL_POS, pc, stop));
+    for (int v = 0; v < 256; ++v)
+    {
+        if (v < TRAP_GETC || v > TRAP_HALT)
+            m[v] = bad;
+    }
+}
+
+static uint64_t mix(uint64_t h, uint64_t key)
+{
+    return (h ^ key) * 0x100000001B3ull;
+}
+
+#define BIT_SET(set, a) ((set)[(a) >> 3] |= (uint8_t)(1 << ((a) & 7)))
+#define BIT_TEST(set, a) ((set)[(a) >> 3] & (1 << ((a) & 7)))
+
+// FNV-1a over the routine at entry as described above; 0 if it cannot be
+// matched: it leaves system space, is longer than OS_MAX_ROUTINE, jumps
+// somewhere other than through RET, or nests TRAPs too deeply
+static uint64_t routine_hash(const uint16_t *m, uint16_t entry, int depth)
+{
+    uint8_t seen[LC3_USER_BASE / 8], stored[LC3_USER_BASE / 8];
+    uint16_t work[2 * OS_MAX_ROUTINE + 1];
+    int top = 0, count = 0;
+
+    if (depth > OS_MAX_NESTING)
+        return 0;
+    memset(seen, 0, sizeof(seen));
+    memset(stored, 0, sizeof(stored));
+
+    // Find the instructions, and the words the routine stores to
+    work[top++] = entry;
+    while (top)
+    {
+        uint16_t pc = work[--top];
+        if (pc >= LC3_USER_BASE)
+            return 0;
+        if (BIT_TEST(seen, pc))
+            continue;
+        if (++count > OS_MAX_ROUTINE)
+            return 0;
+        BIT_SET(seen, pc);
+
+        uint16_t w = m[pc];
+        uint16_t target = (uint16_t)(pc + 1 + sign_extend(w & 0x1FF, 9));
+        switch (w >> 12)
+        {
+        case OP_BR:
+            if ((w & 0x0E00) != 0x0E00)
+                work[top++] = pc + 1;
+            if (w & 0x0E00)
+                work[top++] = target;
+            break;
+        case OP_JMP:
+            if (w != RET_WORD)
+                return 0;
+            break;
+        case OP_RTI:
+            break;
+        case OP_JSR:
+            return 0;
+        case OP_ST:
+            if (target < LC3_USER_BASE)
+                BIT_SET(stored, target);
+            work[top++] = pc + 1;
+            break;
+        default:
+            work[top++] = pc + 1;
+            break;
+        }
+    }
+
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (uint16_t pc = 0; pc < LC3_USER_BASE; ++pc)
+    {
+        if (!BIT_TEST(seen, pc))
+            continue;
+        uint16_t w = m[pc];
+        uint16_t target = (uint16_t)(pc + 1 + sign_extend(w & 0x1FF, 9));
+        h = mix(h, (uint64_t)(uint16_t)(pc - entry) << 16 | w);
+
+        switch (w >> 12)
+        {
+        case OP_LD:
+            if (target >= LC3_USER_BASE || !BIT_TEST(stored, target))
+                h = mix(h, m[target]);
+            break;
+        case OP_LDI:
+        case OP_STI:
+            h = mix(h, m[target]);
+            break;
+        case OP_LEA:
+            for (int i = 0; i < OS_MAX_STRING; ++i)
+            {
+                uint16_t c = m[(uint16_t)(target + i)];
+                h = mix(h, c);
+                if (!c)
+                    break;
+            }
+            break;
+        case OP_TRAP:
+        {
+            uint64_t callee = routine_hash(m, m[w & 0xFF], depth + 1);
+            if (!callee)
+                return 0;
+            h = mix(h, callee);
+            break;
+        }
+        }
+    }
+    return h ? h : 1;
+}
+
+static void init_builtin(void)
+{
+    static uint16_t m[MEMORY_MAX];
+    static const int routines[] = {TRAP_GETC, TRAP_OUT, TRAP_PUTS, TRAP_IN, TRAP_PUTSP, TRAP_HALT};
+
+    build_os(m);
+    for (size_t i = 0; i < sizeof(routines) / sizeof(routines[0]); ++i)
+    {
+        builtin[builtin_count].hash = routine_hash(m, m[routines[i]], 0);
+        builtin[builtin_count++].routine = routines[i];
+    }
+    builtin[builtin_count].hash = routine_hash(m, m[0], 0);
+    builtin[builtin_count++].routine = LC3_OS_BAD_TRAP;
+}
+
+int lc3_os_enable(lc3_vm *vm)
+{
+    if (!vm->os)
+    {
+        vm->os = calloc(1, sizeof(*vm->os));
+        if (!vm->os)
+            return 0;
+    }
+    pthread_once(&builtin_once, init_builtin);
+    return 1;
+}
+
+void lc3_os_disable(lc3_vm *vm)
+{
+    free(vm->os);
+    vm->os = NULL;
+}
+
+// Write the built-in OS into system space and switch to guest-OS traps
+int lc3_os_install(lc3_vm *vm)
+{
+    if (!lc3_os_enable(vm))
+        return 0;
+    build_os(vm->memory);
+    vm->snapshot_id = 0;
+    memset(vm->dirty, LC3_DIRTY_ALL, LC3_USER_BASE >> LC3_PAGE_SHIFT);
+    lc3_invalidate_decoded(vm);
+    return 1;
+}
+
+// Forget resolved routines if system space was written since the last trap
+static void check_system_pages(lc3_vm *vm)
+{
+    uint8_t written = 0;
+    for (int page = 0; page < (LC3_USER_BASE >> LC3_PAGE_SHIFT); ++page)
+    {
+        written |= vm->dirty[page];
+    }
+    if (written & LC3_DIRTY_OS)
+    {
+        for (int page = 0; page < (LC3_USER_BASE >> LC3_PAGE_SHIFT); ++page)
+        {
+            vm->dirty[page] &= ~LC3_DIRTY_OS;
+        }
+        memset(vm->os->state, OS_UNRESOLVED, sizeof(vm->os->state));
+    }
+}
+
+// The trap routine vector leads to: a TRAP_* code or LC3_OS_BAD_TRAP if it
+// is a built-in OS routine that exec_trap runs natively, LC3_OS_GUEST
+// otherwise
+int lc3_os_native(lc3_vm *vm, uint8_t vector)
+{
+    struct lc3_os *os = vm->os;
+
+    check_system_pages(vm);
+    if (os->state[vector] == OS_UNRESOLVED)
+    {
+        uint64_t hash = routine_hash(vm->memory, vm->memory[vector], 0);
+        os->routine[vector] = LC3_OS_GUEST;
+        for (int i = 0; hash && i < builtin_count; ++i)
+        {
+            if (builtin[i].hash == hash)
+                os->routine[vector] = (int16_t)builtin[i].routine;
+        }
+        os->state[vector] = OS_RESOLVED;
+    }
+    return os->routine[vector];
+}
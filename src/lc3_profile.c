@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "lc3.h"
+
+// Reports for the LC3_PROFILE counters. Trap time is measured in TSC
+// cycles on x86 and in nanoseconds elsewhere.
+
+uint64_t lc3_profile_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#ifdef LC3_PROFILE
+
+static const char *const op_names[16] = {
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"};
+
+static const char *ticks_unit(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return "cycles";
+#else
+    return "ns";
+#endif
+}
+
+static void report_text(const lc3_vm *vm, FILE *f)
+{
+    const lc3_profile *p = &vm->prof;
+    uint64_t total = 0;
+    for (int op = 0; op < 16; ++op)
+        total += p->op[op];
+
+    fprintf(f, "instructions: %llu\n", (unsigned long long)total);
+    for (int op = 0; op < 16; ++op)
+    {
+        if (p->op[op])
+            fprintf(f, "  %-5s %14llu  %5.1f%%\n", op_names[op], (unsigned long long)p->op[op],
+                    100.0 * p->op[op] / total);
+    }
+    fprintf(f, "branches: %llu taken, %llu not taken\n",
+            (unsigned long long)p->br_taken, (unsigned long long)p->br_not_taken);
+    fprintf(f, "kbsr polls: %llu\n", (unsigned long long)p->kbsr_polls);
+    fprintf(f, "traps (%s):\n", ticks_unit());
+    for (int t = 0; t < 256; ++t)
+    {
+        if (p->trap[t])
+            fprintf(f, "  x%02X %14llu calls %18llu\n", t, (unsigned long long)p->trap[t],
+                    (unsigned long long)p->trap_ticks[t]);
+    }
+}
+
+static void report_json(const lc3_vm *vm, FILE *f)
+{
+    const lc3_profile *p = &vm->prof;
+    const char *sep = "";
+
+    fprintf(f, "{\"opcodes\":{");
+    for (int op = 0; op < 16; ++op)
+    {
+        fprintf(f, "%s\"%s\":%llu", sep, op_names[op], (unsigned long long)p->op[op]);
+        sep = ",";
+    }
+    fprintf(f, "},\"branches\":{\"taken\":%llu,\"not_taken\":%llu},\"kbsr_polls\":%llu,",
+            (unsigned long long)p->br_taken, (unsigned long long)p->br_not_taken,
+            (unsigned long long)p->kbsr_polls);
+    fprintf(f, "\"trap_time_unit\":\"%s\",\"traps\":{", ticks_unit());
+    sep = "";
+    for (int t = 0; t < 256; ++t)
+    {
+        if (p->trap[t])
+        {
+            fprintf(f, "%s\"x%02X\":{\"calls\":%llu,\"time\":%llu}", sep, t,
+                    (unsigned long long)p->trap[t], (unsigned long long)p->trap_ticks[t]);
+            sep = ",";
+        }
+    }
+    fprintf(f, "}}\n");
+}
+
+void lc3_profile_report(lc3_vm *vm, FILE *f, int json)
+{
+    if (json)
+        report_json(vm, f);
+    else
+        report_text(vm, f);
+}
+
+#else
+
+void lc3_profile_report(lc3_vm *vm, FILE *f, int json)
+{
+    (void)vm;
+    (void)f;
+    (void)json;
+}
+
+#endif // LC3_PROFILE
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lc3.h"
+
+// Deterministic input record/replay. Guest input reaches the VM only through
+// KBSR polls (lc3_in_poll) and the GETC/IN traps (lc3_in_getc); with a log
+// attached, both go through lc3_input_log_read. Recording passes them on to
+// the keyboard ring and logs each result against the instruction count.
+// Replaying answers them from the log alone, so no input is read at all.
+//
+// Polls that find no key are not logged: in a deterministic guest they are
+// exactly the polls at instruction counts without a logged event. End of
+// input is logged once, as every later read returns 0xFFFF as well.
+//
+// File format:
+//   char    magic[4]   "LC3I"
+//   uint16  version    1 (big-endian)
+//   events: varint instruction count since the previous event, a kind byte
+//           (LC3_INPUT_*) and, except for LC3_INPUT_EOF, a varint value
+// Varints are little-endian base-128.
+
+#define LOG_VERSION 1
+
+struct lc3_input_log
+{
+    FILE *file;
+    int replaying;
+    int eof;   // input has ended; every later read returns 0xFFFF
+    int error; // a write failed, or the guest did not read what was logged
+    uint64_t last_count;
+
+    // Replay: the next logged event
+    int has_next;
+    int next_kind;
+    uint64_t next_count;
+    uint16_t next_value;
+};
+
+static void put_varint(FILE *f, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        putc((int)(v & 0x7F) | 0x80, f);
+        v >>= 7;
+    }
+    putc((int)v, f);
+}
+
+static int get_varint(FILE *f, uint64_t *v)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        int c = getc(f);
+        if (c == EOF)
+            return 0;
+        result |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+        {
+            *v = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Read ahead one event; a truncated or malformed tail ends the log
+static void read_next(struct lc3_input_log *log)
+{
+    uint64_t delta, value = 0;
+    int kind;
+
+    log->has_next = 0;
+    if (!get_varint(log->file, &delta) || (kind = getc(log->file)) == EOF)
+        return;
+    if (kind != LC3_INPUT_EOF && (!get_varint(log->file, &value) || value > 0xFFFF))
+        return;
+    if (kind != LC3_INPUT_POLL && kind != LC3_INPUT_GETC && kind != LC3_INPUT_EOF)
+        return;
+
+    log->next_count = log->last_count + delta;
+    log->next_kind = kind;
+    log->next_value = (uint16_t)value;
+    log->last_count = log->next_count;
+    log->has_next = 1;
+}
+
+static struct lc3_input_log *open_log(lc3_vm *vm, const char *path, int replaying)
+{
+    lc3_input_log_close(vm);
+
+    struct lc3_input_log *log = calloc(1, sizeof(*log));
+    if (!log)
+        return NULL;
+    log->file = fopen(path, replaying ? "rb" : "wb");
+    if (!log->file)
+    {
+        free(log);
+        return NULL;
+    }
+    log->replaying = replaying;
+    vm->input_log = log;
+    return log;
+}
+
+// Log every input the guest reads to path
+int lc3_record_input(lc3_vm *vm, const char *path)
+{
+    struct lc3_input_log *log = open_log(vm, path, 0);
+    if (!log)
+        return 0;
+    fwrite("LC3I\0\1", 6, 1, log->file);
+    log->last_count = vm->instr_count;
+    return 1;
+}
+
+// Answer the guest's input from a log written by lc3_record_input. The VM
+// must be in the state the recording started from.
+int lc3_replay_input(lc3_vm *vm, const char *path)
+{
+    struct lc3_input_log *log = open_log(vm, path, 1);
+    if (!log)
+        return 0;
+
+    unsigned char header[6];
+    if (fread(header, sizeof(header), 1, log->file) != 1 || memcmp(header, "LC3I", 4) != 0 ||
+        ((header[4] << 8) | header[5]) != LOG_VERSION)
+    {
+        lc3_input_log_close(vm);
+        return 0;
+    }
+    log->last_count = vm->instr_count;
+    read_next(log);
+    return 1;
+}
+
+// Detach the log. Returns 0 if a recording could not be written in full or
+// a replay diverged from its log or left some of it unread.
+int lc3_input_log_close(lc3_vm *vm)
+{
+    struct lc3_input_log *log = vm->input_log;
+    if (!log)
+        return 1;
+
+    int ok = !log->error && !(log->replaying && log->has_next);
+    if (fclose(log->file) != 0)
+        ok = 0;
+    free(log);
+    vm->input_log = NULL;
+    return ok;
+}
+
+static void append(struct lc3_input_log *log, uint64_t count, int kind, int value)
+{
+    put_varint(log->file, count - log->last_count);
+    putc(kind, log->file);
+    if (kind != LC3_INPUT_EOF)
+        put_varint(log->file, (uint64_t)value);
+    log->last_count = count;
+    if (ferror(log->file))
+        log->error = 1;
+}
+
+static int replay(struct lc3_input_log *log, uint64_t count, int kind)
+{
+    if (log->has_next && log->next_count == count &&
+        (log->next_kind == kind || log->next_kind == LC3_INPUT_EOF))
+    {
+        int value = log->next_kind == LC3_INPUT_EOF ? 0xFFFF : log->next_value;
+        log->eof = log->next_kind == LC3_INPUT_EOF;
+        read_next(log);
+        return value;
+    }
+
+    // An empty poll before the next event is expected; anything else means
+    // the guest is no longer doing what it did when recorded
+    if (kind == LC3_INPUT_POLL && (!log->has_next || log->next_count > count))
+        return -1;
+    log->error = 1;
+    log->eof = 1;
+    return 0xFFFF;
+}
+
+// A KBSR poll (-1 when no key is ready) or a blocking GETC, as seen through
+// the log. Reached from lc3_in_poll and lc3_in_getc.
+int lc3_input_log_read(lc3_vm *vm, int kind)
+{
+    struct lc3_input_log *log = vm->input_log;
+
+    if (log->eof)
+        return 0xFFFF;
+    if (log->replaying)
+        return replay(log, vm->instr_count, kind);
+
+    int c = kind == LC3_INPUT_POLL ? lc3_in_take(vm) : lc3_in_wait(vm);
+    if (c == 0xFFFF)
+    {
+        append(log, vm->instr_count, LC3_INPUT_EOF, 0);
+        log->eof = 1;
+    }
+    else if (c >= 0)
+    {
+        append(log, vm->instr_count, kind, c);
+    }
+    return c;
+}
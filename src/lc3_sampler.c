@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "lc3.h"
+
+// Sampling profiler. A sample is taken every `interval` instructions, or on
+// each SIGPROF tick when interval is 0 (see lc3_sample_timer). lc3_run
+// uses the reference loop while a sampler is attached, which checks for a
+// due sample before every instruction.
+//
+// Guest call stacks are rebuilt from JSR/JSRR (push the callee) and JMP R7
+// (RET, pop). Each sample adds to a per-PC histogram and to a table of
+// distinct stacks, written out in the folded format flamegraph.pl reads.
+
+#define SAMPLER_DEPTH 64
+#define SAMPLER_MIN_BUCKETS 1024
+
+typedef struct
+{
+    uint16_t address;
+    char *name;
+} symbol;
+
+typedef struct
+{
+    uint64_t hash; // 0 marks a free bucket
+    uint64_t count;
+    size_t offset; // into frames
+    size_t length;
+} stack_entry;
+
+struct lc3_sampler
+{
+    uint64_t interval;
+    uint64_t next_due; // instruction count of the next sample
+    uint64_t samples;
+    uint64_t lost; // samples whose stack could not be stored
+    uint16_t root; // PC when sampling started
+    int depth;     // may exceed SAMPLER_DEPTH; deeper frames are not kept
+    uint16_t stack[SAMPLER_DEPTH];
+    uint64_t hist[MEMORY_MAX];
+
+    stack_entry *buckets;
+    size_t bucket_count;
+    size_t used;
+    uint16_t *frames;
+    size_t frames_len;
+    size_t frames_cap;
+
+    symbol *symbols; // sorted by address
+    size_t symbol_count;
+};
+
+int lc3_sampler_enable(lc3_vm *vm, uint64_t interval)
+{
+    lc3_sampler_disable(vm);
+
+    struct lc3_sampler *s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        return 0;
+    }
+    s->buckets = calloc(SAMPLER_MIN_BUCKETS, sizeof(stack_entry));
+    if (!s->buckets)
+    {
+        free(s);
+        return 0;
+    }
+    s->bucket_count = SAMPLER_MIN_BUCKETS;
+    s->interval = interval;
+    s->next_due = vm->instr_count + interval;
+    s->root = vm->reg[R_PC];
+    vm->sampler = s;
+    return 1;
+}
+
+void lc3_sampler_disable(lc3_vm *vm)
+{
+    struct lc3_sampler *s = vm->sampler;
+    if (!s)
+    {
+        return;
+    }
+    for (size_t i = 0; i < s->symbol_count; ++i)
+    {
+        free(s->symbols[i].name);
+    }
+    free(s->symbols);
+    free(s->buckets);
+    free(s->frames);
+    free(s);
+    vm->sampler = NULL;
+}
+
+void lc3_sampler_call(lc3_vm *vm, uint16_t target)
+{
+    struct lc3_sampler *s = vm->sampler;
+    if (s->depth < SAMPLER_DEPTH)
+    {
+        s->stack[s->depth] = target;
+    }
+    s->depth++;
+}
+
+void lc3_sampler_return(lc3_vm *vm)
+{
+    if (vm->sampler->depth > 0)
+    {
+        vm->sampler->depth--;
+    }
+}
+
+static uint64_t hash_frames(const uint16_t *frames, size_t length)
+{
+    // FNV-1a, never 0 so that 0 can mark free buckets
+    uint64_t h = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < length; ++i)
+    {
+        h = (h ^ frames[i]) * 0x100000001B3ull;
+    }
+    return h ? h : 1;
+}
+
+static stack_entry *find_bucket(stack_entry *buckets, size_t count, uint64_t hash,
+                                const uint16_t *pool, const uint16_t *frames, size_t length)
+{
+    for (size_t i = hash & (count - 1);; i = (i + 1) & (count - 1))
+    {
+        stack_entry *e = &buckets[i];
+        if (!e->hash)
+            return e;
+        if (e->hash == hash && e->length == length &&
+            memcmp(pool + e->offset, frames, length * sizeof(uint16_t)) == 0)
+            return e;
+    }
+}
+
+static int grow_buckets(struct lc3_sampler *s)
+{
+    size_t count = s->bucket_count * 2;
+    stack_entry *buckets = calloc(count, sizeof(stack_entry));
+    if (!buckets)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < s->bucket_count; ++i)
+    {
+        stack_entry *e = &s->buckets[i];
+        if (e->hash)
+        {
+            *find_bucket(buckets, count, e->hash, s->frames, s->frames + e->offset, e->length) = *e;
+        }
+    }
+    free(s->buckets);
+    s->buckets = buckets;
+    s->bucket_count = count;
+    return 1;
+}
+
+static void record_stack(struct lc3_sampler *s, uint16_t pc)
+{
+    uint16_t frames[SAMPLER_DEPTH + 2];
+    size_t length = 0;
+    int kept = s->depth < SAMPLER_DEPTH ? s->depth : SAMPLER_DEPTH;
+
+    frames[length++] = s->root;
+    for (int i = 0; i < kept; ++i)
+    {
+        frames[length++] = s->stack[i];
+    }
+    frames[length++] = pc;
+
+    uint64_t hash = hash_frames(frames, length);
+    stack_entry *e = find_bucket(s->buckets, s->bucket_count, hash, s->frames, frames, length);
+    if (e->hash)
+    {
+        e->count++;
+        return;
+    }
+
+    // Keep the table at most half full so find_bucket always ends; out of
+    // memory, the stack is dropped rather than stored
+    if ((s->used + 1) * 2 > s->bucket_count)
+    {
+        if (!grow_buckets(s))
+        {
+            s->lost++;
+            return;
+        }
+        e = find_bucket(s->buckets, s->bucket_count, hash, s->frames, frames, length);
+    }
+    if (s->frames_len + length > s->frames_cap)
+    {
+        size_t cap = s->frames_cap ? s->frames_cap * 2 : 4096;
+        uint16_t *grown = realloc(s->frames, cap * sizeof(uint16_t));
+        if (!grown)
+        {
+            s->lost++;
+            return;
+        }
+        s->frames = grown;
+        s->frames_cap = cap;
+    }
+    memcpy(s->frames + s->frames_len, frames, length * sizeof(uint16_t));
+    e->hash = hash;
+    e->count = 1;
+    e->offset = s->frames_len;
+    e->length = length;
+    s->frames_len += length;
+    s->used++;
+}
+
+// Called from the engines' budget check: take a sample if one is due or was
+// requested by the timer. Returns the instruction count of the next one.
+uint64_t lc3_sample_tick(lc3_vm *vm, uint64_t count, int requested)
+{
+    struct lc3_sampler *s = vm->sampler;
+
+    if (requested || (s->interval && count >= s->next_due))
+    {
+        uint16_t pc = vm->reg[R_PC];
+        s->hist[pc]++;
+        s->samples++;
+        record_stack(s, pc);
+        if (s->interval)
+            s->next_due = count + s->interval;
+    }
+    return s->interval ? s->next_due : UINT64_MAX;
+}
+
+static int symbol_cmp(const void *a, const void *b)
+{
+    const symbol *x = a, *y = b;
+    return (int)x->address - (int)y->address;
+}
+
+// Read an lc3as-style .sym file: lines of "<name> <hex address>", optionally
+// behind "//" comment markers; headers and anything else are skipped
+int lc3_symbols_load(lc3_vm *vm, const char *path)
+{
+    struct lc3_sampler *s = vm->sampler;
+    FILE *file = fopen(path, "r");
+    if (!s || !file)
+    {
+        if (file)
+            fclose(file);
+        return 0;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        char name[128], addr[16], *end;
+        const char *p = line;
+        while (*p == '/' || isspace((unsigned char)*p))
+            ++p;
+        if (sscanf(p, "%127s %15s", name, addr) != 2)
+            continue;
+
+        const char *digits = (addr[0] == 'x' || addr[0] == 'X') ? addr + 1 : addr;
+        unsigned long address = strtoul(digits, &end, 16);
+        if (*end || end == digits || address > 0xFFFF)
+            continue;
+
+        symbol *grown = realloc(s->symbols, (s->symbol_count + 1) * sizeof(symbol));
+        if (!grown)
+            break;
+        s->symbols = grown;
+        s->symbols[s->symbol_count].address = (uint16_t)address;
+        s->symbols[s->symbol_count].name = strdup(name);
+        s->symbol_count++;
+    }
+    fclose(file);
+
+    qsort(s->symbols, s->symbol_count, sizeof(symbol), symbol_cmp);
+    return 1;
+}
+
+// Nearest symbol at or below address, or NULL
+static const symbol *lookup(const struct lc3_sampler *s, uint16_t address)
+{
+    size_t lo = 0, hi = s->symbol_count;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (s->symbols[mid].address <= address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo ? &s->symbols[lo - 1] : NULL;
+}
+
+// Callers are named by symbol; the leaf also gets its offset so every
+// stack prints as a distinct line
+static void print_frame(FILE *f, const struct lc3_sampler *s, uint16_t address, int leaf)
+{
+    const symbol *sym = lookup(s, address);
+    if (!sym)
+        fprintf(f, "x%04X", address);
+    else if (leaf && address != sym->address)
+        fprintf(f, "%s+%d", sym->name, address - sym->address);
+    else
+        fputs(sym->name, f);
+}
+
+// One line per distinct stack: "root;callee;...;leaf count"
+int lc3_sampler_write_folded(lc3_vm *vm, FILE *f)
+{
+    const struct lc3_sampler *s = vm->sampler;
+    if (!s)
+    {
+        return 0;
+    }
+
+    for (size_t i = 0; i < s->bucket_count; ++i)
+    {
+        const stack_entry *e = &s->buckets[i];
+        if (!e->hash)
+            continue;
+        const uint16_t *frames = s->frames + e->offset;
+        for (size_t j = 0; j < e->length; ++j)
+        {
+            if (j)
+                fputc(';', f);
+            print_frame(f, s, frames[j], j + 1 == e->length);
+        }
+        fprintf(f, " %llu\n", (unsigned long long)e->count);
+    }
+    return !ferror(f);
+}
+
+// The top hottest PCs, labelled as symbol+offset where possible
+void lc3_sampler_report(lc3_vm *vm, FILE *f, int top)
+{
+    const struct lc3_sampler *s = vm->sampler;
+    if (!s || !s->samples)
+    {
+        return;
+    }
+
+    fprintf(f, "samples: %llu\n", (unsigned long long)s->samples);
+    if (s->lost)
+        fprintf(f, "stacks lost (out of memory): %llu\n", (unsigned long long)s->lost);
+    uint64_t last = UINT64_MAX;
+    int last_pc = MEMORY_MAX;
+    for (int n = 0; n < top; ++n)
+    {
+        // Next entry in (count desc, pc asc) order
+        int best = -1;
+        for (int pc = 0; pc < MEMORY_MAX; ++pc)
+        {
+            uint64_t c = s->hist[pc];
+            if (!c || c > last || (c == last && pc <= last_pc))
+                continue;
+            if (best < 0 || c > s->hist[best])
+                best = pc;
+        }
+        if (best < 0)
+            break;
+
+        const symbol *sym = lookup(s, (uint16_t)best);
+        fprintf(f, "  x%04X %6.2f%%  ", best, 100.0 * s->hist[best] / s->samples);
+        if (sym)
+            fprintf(f, "%s+%d\n", sym->name, best - sym->address);
+        else
+            fputc('\n', f);
+        last = s->hist[best];
+        last_pc = best;
+    }
+}
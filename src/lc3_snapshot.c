@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lc3.h"
+
+// Machine snapshots for warm-starting the same program many times.
+//
+// A VM remembers which snapshot its memory last matched (saved to or
+// restored from) and which pages were written since, so restoring that same
+// snapshot again only copies the dirty pages back. Any other snapshot is
+// restored in full.
+//
+// File format, big-endian:
+//   char     magic[4]        "LC3S"
+//   uint16   version         2
+//   uint16   reg[R_COUNT]    including R_PC and R_COND
+//   uint16   cc
+//   uint16   psr, saved_ssp, saved_usp
+//   uint64   instr_count
+//   uint16   output_length   guest output not yet written to the host
+//   uint8    present[LC3_PAGE_COUNT / 8]  bitmap of non-zero pages
+//   uint8    output[output_length]
+//   uint16   words[LC3_PAGE_SIZE] for each present page, in address order
+
+#define SNAPSHOT_VERSION 2
+
+struct lc3_snapshot
+{
+    uint64_t id;
+    uint16_t memory[MEMORY_MAX];
+    uint16_t reg[R_COUNT];
+    uint16_t cc;
+    uint16_t psr;
+    uint16_t saved_ssp;
+    uint16_t saved_usp;
+    uint64_t instr_count;
+    size_t output_length;
+    char output[LC3_OUT_BUFFER_SIZE];
+};
+
+static uint64_t next_snapshot_id = 0;
+
+static uint64_t new_snapshot_id(void)
+{
+    return __atomic_add_fetch(&next_snapshot_id, 1, __ATOMIC_RELAXED);
+}
+
+lc3_snapshot *lc3_snapshot_save(lc3_vm *vm)
+{
+    lc3_snapshot *snap = malloc(sizeof(*snap));
+    if (!snap)
+    {
+        return NULL;
+    }
+
+    snap->id = new_snapshot_id();
+    memcpy(snap->memory, vm->memory, sizeof(snap->memory));
+    memcpy(snap->reg, vm->reg, sizeof(snap->reg));
+    snap->cc = vm->cc;
+    snap->psr = vm->psr;
+    snap->saved_ssp = vm->saved_ssp;
+    snap->saved_usp = vm->saved_usp;
+    snap->instr_count = vm->instr_count;
+
+    const lc3_output *out = &vm->out;
+    snap->output_length = out->tail - out->head;
+    for (size_t i = 0; i < snap->output_length; ++i)
+    {
+        snap->output[i] = out->buf[(out->head + i) & (LC3_OUT_BUFFER_SIZE - 1)];
+    }
+
+    vm->snapshot_id = snap->id;
+    for (size_t page = 0; page < LC3_PAGE_COUNT; ++page)
+    {
+        vm->dirty[page] &= ~LC3_DIRTY_SNAPSHOT;
+    }
+    return snap;
+}
+
+// Copy one page back and drop anything decoded or translated from it
+static void restore_page(lc3_vm *vm, const lc3_snapshot *snap, size_t page)
+{
+    size_t first = page << LC3_PAGE_SHIFT;
+
+    memcpy(vm->memory + first, snap->memory + first, LC3_PAGE_SIZE * sizeof(uint16_t));
+    vm->dirty[page] = LC3_DIRTY_FORK | LC3_DIRTY_OS;
+    if (vm->decoded)
+    {
+        // Starting with the word before, which may be fused with the first
+        for (size_t a = first; a < first + LC3_PAGE_SIZE; ++a)
+        {
+            vm->decoded[a].handler = NULL;
+        }
+        vm->decoded[(uint16_t)(first - 1)].handler = NULL;
+    }
+#ifdef LC3_JIT
+    if (vm->jit)
+    {
+        for (size_t a = first; a < first + LC3_PAGE_SIZE; ++a)
+        {
+            lc3_jit_invalidate(vm->jit, (uint16_t)a);
+        }
+    }
+#endif
+}
+
+int lc3_snapshot_restore(lc3_vm *vm, const lc3_snapshot *snap)
+{
+    if (vm->running)
+    {
+        return 0;
+    }
+
+    if (vm->snapshot_id == snap->id)
+    {
+        for (size_t page = 0; page < LC3_PAGE_COUNT; ++page)
+        {
+            if (vm->dirty[page] & LC3_DIRTY_SNAPSHOT)
+            {
+                restore_page(vm, snap, page);
+            }
+        }
+    }
+    else
+    {
+        memcpy(vm->memory, snap->memory, sizeof(vm->memory));
+        memset(vm->dirty, LC3_DIRTY_FORK | LC3_DIRTY_OS, sizeof(vm->dirty));
+        lc3_invalidate_decoded(vm);
+        vm->snapshot_id = snap->id;
+    }
+
+    memcpy(vm->reg, snap->reg, sizeof(vm->reg));
+    vm->cc = snap->cc;
+    vm->psr = snap->psr;
+    vm->saved_ssp = snap->saved_ssp;
+    vm->saved_usp = snap->saved_usp;
+    vm->instr_count = snap->instr_count;
+
+    // Output of the previous run still goes out before the snapshot's
+    lc3_out_flush(vm);
+    vm->out.head = vm->out.tail = 0;
+    lc3_out_write(vm, snap->output, snap->output_length);
+    return 1;
+}
+
+void lc3_snapshot_free(lc3_snapshot *snap)
+{
+    free(snap);
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static int page_present(const lc3_snapshot *snap, size_t page)
+{
+    const uint16_t *words = snap->memory + (page << LC3_PAGE_SHIFT);
+    for (size_t i = 0; i < LC3_PAGE_SIZE; ++i)
+    {
+        if (words[i])
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int lc3_snapshot_write(const lc3_snapshot *snap, const char *path)
+{
+    uint8_t header[6 + R_COUNT * 2 + 8 + 8 + 2 + LC3_PAGE_COUNT / 8];
+    uint8_t *p = header;
+
+    memcpy(p, "LC3S", 4);
+    put16(p + 4, SNAPSHOT_VERSION);
+    p += 6;
+    for (int r = 0; r < R_COUNT; ++r, p += 2)
+    {
+        put16(p, snap->reg[r]);
+    }
+    put16(p, snap->cc);
+    put16(p + 2, snap->psr);
+    put16(p + 4, snap->saved_ssp);
+    put16(p + 6, snap->saved_usp);
+    p += 8;
+    for (int i = 0; i < 8; ++i)
+    {
+        *p++ = (uint8_t)(snap->instr_count >> (56 - 8 * i));
+    }
+    put16(p, (uint16_t)snap->output_length);
+    p += 2;
+    memset(p, 0, LC3_PAGE_COUNT / 8);
+    for (size_t page = 0; page < LC3_PAGE_COUNT; ++page)
+    {
+        if (page_present(snap, page))
+        {
+            p[page >> 3] |= 1 << (page & 7);
+        }
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        return 0;
+    }
+
+    int ok = fwrite(header, sizeof(header), 1, file) == 1;
+    if (ok && snap->output_length)
+    {
+        ok = fwrite(snap->output, snap->output_length, 1, file) == 1;
+    }
+    for (size_t page = 0; ok && page < LC3_PAGE_COUNT; ++page)
+    {
+        if (p[page >> 3] & (1 << (page & 7)))
+        {
+            uint8_t words[LC3_PAGE_SIZE * 2];
+            for (size_t i = 0; i < LC3_PAGE_SIZE; ++i)
+            {
+                put16(words + i * 2, snap->memory[(page << LC3_PAGE_SHIFT) + i]);
+            }
+            ok = fwrite(words, sizeof(words), 1, file) == 1;
+        }
+    }
+
+    if (fclose(file) != 0)
+    {
+        ok = 0;
+    }
+    return ok;
+}
+
+lc3_snapshot *lc3_snapshot_read(const char *path)
+{
+    uint8_t header[6 + R_COUNT * 2 + 8 + 8 + 2 + LC3_PAGE_COUNT / 8];
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return NULL;
+    }
+
+    lc3_snapshot *snap = calloc(1, sizeof(*snap));
+    if (!snap)
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    int ok = fread(header, sizeof(header), 1, file) == 1 &&
+             memcmp(header, "LC3S", 4) == 0 &&
+             get16(header + 4) == SNAPSHOT_VERSION;
+
+    const uint8_t *p = header + 6;
+    if (ok)
+    {
+        for (int r = 0; r < R_COUNT; ++r, p += 2)
+        {
+            snap->reg[r] = get16(p);
+        }
+        snap->cc = get16(p);
+        snap->psr = get16(p + 2);
+        snap->saved_ssp = get16(p + 4);
+        snap->saved_usp = get16(p + 6);
+        p += 8;
+        for (int i = 0; i < 8; ++i)
+        {
+            snap->instr_count = (snap->instr_count << 8) | *p++;
+        }
+        snap->output_length = get16(p);
+        p += 2;
+        ok = snap->output_length <= LC3_OUT_BUFFER_SIZE;
+    }
+    if (ok && snap->output_length)
+    {
+        ok = fread(snap->output, snap->output_length, 1, file) == 1;
+    }
+    for (size_t page = 0; ok && page < LC3_PAGE_COUNT; ++page)
+    {
+        if (p[page >> 3] & (1 << (page & 7)))
+        {
+            uint8_t words[LC3_PAGE_SIZE * 2];
+            ok = fread(words, sizeof(words), 1, file) == 1;
+            if (ok)
+            {
+                lc3_copy_be16(snap->memory + (page << LC3_PAGE_SHIFT), words, LC3_PAGE_SIZE);
+            }
+        }
+    }
+    if (ok && fgetc(file) != EOF)
+    {
+        ok = 0;
+    }
+    fclose(file);
+
+    if (!ok)
+    {
+        free(snap);
+        return NULL;
+    }
+    snap->id = new_snapshot_id();
+    return snap;
+}
@@ -0,0 +1,526 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "lc3.h"
+
+// Execution traces. While a tracer is attached, lc3_run uses the reference
+// loop, which hands every executed instruction to lc3_trace_step and every
+// store to lc3_trace_store. Records are delta-encoded against the state the
+// previous record left behind, so a typical instruction costs 2-3 bytes.
+// Full buffers are written out by a background thread; the VM only waits
+// when it gets TRACE_BUFFERS buffers ahead of the disk.
+//
+// Stream format:
+//   char    magic[4]   "LC3T"
+//   uint16  version    1 (big-endian)
+//   records...
+//
+// Each record starts with a header byte:
+//   bit 0     PC is not the previous record's PC + 1; a varint of the
+//             zigzag difference follows
+//   bit 1     instruction word differs from the last one recorded at this
+//             PC; the word follows, big-endian
+//   bits 2-3  number of registers the instruction changed (0-2)
+//   bit 4     stores follow, see below
+//   bit 5     more than two registers changed; a varint with the number
+//             beyond two follows
+//   bits 6-7  new condition code: 0 unchanged, 1 P, 2 Z, 3 N
+// then each changed register as a varint of (zigzag(new - old) << 3 | r),
+// then, for bit 4, a varint count and per store a varint of the zigzag
+// address difference from the previous store and a varint of the value.
+// Register count 3 marks a sync record instead: big-endian PC, R0-R7, the
+// FL_* flags and the 64-bit instruction count, written at the start of
+// every run so that changes made by the host between runs are picked up.
+// Varints are little-endian base-128.
+
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_SIZE (1 << 20)
+#define TRACE_BUFFERS 4
+#define TRACE_RECORD_MAX (1 + 3 + 2 + 1 + 8 * 3 + 1 + LC3_TRACE_MAX_STORES * 6) // worst case
+
+enum
+{
+    TRACE_PC = 1 << 0,
+    TRACE_INSTR = 1 << 1,
+    TRACE_REG_SHIFT = 2,
+    TRACE_SYNC = 3 << TRACE_REG_SHIFT,
+    TRACE_STORES = 1 << 4,
+    TRACE_MORE_REGS = 1 << 5,
+    TRACE_FLAGS_SHIFT = 6
+};
+
+struct lc3_tracer
+{
+    int fd;
+    int error; // a write failed; set by the writer thread
+
+    // State as of the last record
+    uint16_t next_pc;
+    uint16_t reg[8];
+    uint8_t flags;
+    uint16_t last_store;
+    uint16_t instr[MEMORY_MAX]; // last word recorded at each PC
+
+    // Stores made by the current instruction
+    int store_count;
+    uint16_t store_address[LC3_TRACE_MAX_STORES];
+    uint16_t store_value[LC3_TRACE_MAX_STORES];
+
+    // Buffers [consumed, produced) are queued for the writer thread; the VM
+    // fills buffer produced % TRACE_BUFFERS
+    uint8_t *buf[TRACE_BUFFERS];
+    size_t len[TRACE_BUFFERS];
+    uint8_t *out;
+    size_t used;
+    uint64_t produced;
+    uint64_t consumed;
+    int stopping;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+struct lc3_trace_reader
+{
+    FILE *file;
+    uint64_t count;
+    uint16_t next_pc;
+    uint16_t reg[8];
+    uint8_t flags;
+    uint16_t last_store;
+    uint16_t instr[MEMORY_MAX];
+};
+
+static uint32_t zigzag(uint16_t delta)
+{
+    int32_t d = (int16_t)delta;
+    return (uint32_t)(d * 2) ^ (uint32_t)(d >> 31);
+}
+
+static uint16_t unzigzag(uint32_t z)
+{
+    return (uint16_t)((z >> 1) ^ -(z & 1));
+}
+
+static uint8_t *put_varint(uint8_t *p, uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static uint8_t *put_be(uint8_t *p, uint64_t v, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; --i)
+        *p++ = (uint8_t)(v >> (8 * i));
+    return p;
+}
+
+static int write_all(int fd, const uint8_t *p, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct lc3_tracer *t = arg;
+
+    pthread_mutex_lock(&t->lock);
+    for (;;)
+    {
+        while (t->consumed == t->produced && !t->stopping)
+            pthread_cond_wait(&t->changed, &t->lock);
+        if (t->consumed == t->produced)
+            break;
+
+        int i = t->consumed % TRACE_BUFFERS;
+        pthread_mutex_unlock(&t->lock);
+        int ok = write_all(t->fd, t->buf[i], t->len[i]);
+        pthread_mutex_lock(&t->lock);
+
+        if (!ok)
+            t->error = 1;
+        t->consumed++;
+        pthread_cond_broadcast(&t->changed);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+// Queue the buffer being filled and move on to the next free one
+static void submit(struct lc3_tracer *t)
+{
+    pthread_mutex_lock(&t->lock);
+    t->len[t->produced % TRACE_BUFFERS] = t->used;
+    t->produced++;
+    pthread_cond_broadcast(&t->changed);
+    while (t->produced - t->consumed >= TRACE_BUFFERS)
+        pthread_cond_wait(&t->changed, &t->lock);
+    pthread_mutex_unlock(&t->lock);
+
+    t->out = t->buf[t->produced % TRACE_BUFFERS];
+    t->used = 0;
+}
+
+static uint8_t *reserve(struct lc3_tracer *t)
+{
+    if (t->used + TRACE_RECORD_MAX > TRACE_BUFFER_SIZE)
+        submit(t);
+    return t->out + t->used;
+}
+
+static void free_tracer(struct lc3_tracer *t)
+{
+    for (int i = 0; i < TRACE_BUFFERS; ++i)
+        free(t->buf[i]);
+    free(t);
+}
+
+// Start recording to path. Returns 0 if the file or the writer thread
+// could not be set up.
+int lc3_trace_start(lc3_vm *vm, const char *path)
+{
+    lc3_trace_stop(vm);
+
+    struct lc3_tracer *t = calloc(1, sizeof(*t));
+    if (!t)
+        return 0;
+    for (int i = 0; i < TRACE_BUFFERS; ++i)
+    {
+        t->buf[i] = malloc(TRACE_BUFFER_SIZE);
+        if (!t->buf[i])
+        {
+            free_tracer(t);
+            return 0;
+        }
+    }
+
+    t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (t->fd < 0)
+    {
+        free_tracer(t);
+        return 0;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->changed, NULL);
+    if (pthread_create(&t->thread, NULL, writer_thread, t) != 0)
+    {
+        close(t->fd);
+        pthread_mutex_destroy(&t->lock);
+        pthread_cond_destroy(&t->changed);
+        free_tracer(t);
+        return 0;
+    }
+
+    t->out = t->buf[0];
+    memcpy(t->out, "LC3T", 4);
+    put_be(t->out + 4, TRACE_VERSION, 2);
+    t->used = 6;
+    vm->tracer = t;
+    return 1;
+}
+
+// Write out everything recorded and detach the tracer. Returns 0 if any of
+// the trace could not be written.
+int lc3_trace_stop(lc3_vm *vm)
+{
+    struct lc3_tracer *t = vm->tracer;
+    if (!t)
+        return 1;
+
+    if (t->used)
+        submit(t);
+    pthread_mutex_lock(&t->lock);
+    t->stopping = 1;
+    pthread_cond_broadcast(&t->changed);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+
+    int ok = !t->error;
+    if (close(t->fd) != 0)
+        ok = 0;
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->changed);
+    free_tracer(t);
+    vm->tracer = NULL;
+    return ok;
+}
+
+// Record the full machine state; called when a run starts
+void lc3_trace_sync(lc3_vm *vm)
+{
+    struct lc3_tracer *t = vm->tracer;
+    uint8_t *p = reserve(t);
+    uint8_t *start = p;
+
+    t->next_pc = vm->reg[R_PC];
+    memcpy(t->reg, vm->reg, sizeof(t->reg));
+    t->flags = (uint8_t)cond_flags(vm->cc);
+    t->store_count = 0;
+
+    *p++ = TRACE_SYNC;
+    p = put_be(p, t->next_pc, 2);
+    for (int r = R_R0; r <= R_R7; ++r)
+        p = put_be(p, t->reg[r], 2);
+    *p++ = t->flags;
+    p = put_be(p, vm->instr_count, 8);
+    t->used += (size_t)(p - start);
+}
+
+void lc3_trace_store(lc3_vm *vm, uint16_t address, uint16_t value)
+{
+    struct lc3_tracer *t = vm->tracer;
+    if (t->store_count < LC3_TRACE_MAX_STORES)
+    {
+        t->store_address[t->store_count] = address;
+        t->store_value[t->store_count] = value;
+        t->store_count++;
+    }
+}
+
+// Record the instruction just executed from pc
+void lc3_trace_step(lc3_vm *vm, uint16_t pc, uint16_t instr)
+{
+    struct lc3_tracer *t = vm->tracer;
+    uint8_t *p = reserve(t);
+    uint8_t *header = p++;
+    uint8_t h = 0;
+
+    if (pc != t->next_pc)
+    {
+        h |= TRACE_PC;
+        p = put_varint(p, zigzag(pc - t->next_pc));
+    }
+    t->next_pc = pc + 1;
+
+    if (instr != t->instr[pc])
+    {
+        h |= TRACE_INSTR;
+        p = put_be(p, instr, 2);
+        t->instr[pc] = instr;
+    }
+
+    int changed = 0;
+    for (int r = R_R0; r <= R_R7; ++r)
+        changed += vm->reg[r] != t->reg[r];
+    if (changed > 2)
+    {
+        h |= TRACE_MORE_REGS;
+        p = put_varint(p, (uint32_t)changed - 2);
+        changed = 2;
+    }
+    h |= changed << TRACE_REG_SHIFT;
+    for (int r = R_R0; r <= R_R7; ++r)
+    {
+        if (vm->reg[r] != t->reg[r])
+        {
+            p = put_varint(p, zigzag(vm->reg[r] - t->reg[r]) << 3 | (uint32_t)r);
+            t->reg[r] = vm->reg[r];
+        }
+    }
+
+    if (t->store_count)
+    {
+        h |= TRACE_STORES;
+        p = put_varint(p, (uint32_t)t->store_count);
+        for (int i = 0; i < t->store_count; ++i)
+        {
+            p = put_varint(p, zigzag(t->store_address[i] - t->last_store));
+            p = put_varint(p, t->store_value[i]);
+            t->last_store = t->store_address[i];
+        }
+        t->store_count = 0;
+    }
+
+    uint8_t flags = (uint8_t)cond_flags(vm->cc);
+    if (flags != t->flags)
+    {
+        // FL_POS, FL_ZRO, FL_NEG are 1, 2, 4
+        h |= (flags == FL_NEG ? 3 : flags) << TRACE_FLAGS_SHIFT;
+        t->flags = flags;
+    }
+
+    *header = h;
+    t->used += (size_t)(p - header);
+}
+
+lc3_trace_reader *lc3_trace_open(const char *path)
+{
+    lc3_trace_reader *r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+    r->file = fopen(path, "rb");
+    if (!r->file)
+    {
+        free(r);
+        return NULL;
+    }
+    setvbuf(r->file, NULL, _IOFBF, 1 << 16);
+
+    uint8_t header[6];
+    if (fread(header, sizeof(header), 1, r->file) != 1 || memcmp(header, "LC3T", 4) != 0 ||
+        ((header[4] << 8) | header[5]) != TRACE_VERSION)
+    {
+        lc3_trace_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+void lc3_trace_close(lc3_trace_reader *r)
+{
+    if (r)
+    {
+        fclose(r->file);
+        free(r);
+    }
+}
+
+static int get_varint(FILE *f, uint32_t *v)
+{
+    uint32_t result = 0;
+    for (int shift = 0; shift < 32; shift += 7)
+    {
+        int c = getc(f);
+        if (c == EOF)
+            return 0;
+        result |= (uint32_t)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+        {
+            *v = result;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int get_be(FILE *f, uint64_t *v, int bytes)
+{
+    uint64_t result = 0;
+    for (int i = 0; i < bytes; ++i)
+    {
+        int c = getc(f);
+        if (c == EOF)
+            return 0;
+        result = (result << 8) | (uint64_t)c;
+    }
+    *v = result;
+    return 1;
+}
+
+static int read_sync(lc3_trace_reader *r)
+{
+    uint64_t v;
+    if (!get_be(r->file, &v, 2))
+        return 0;
+    r->next_pc = (uint16_t)v;
+    for (int i = R_R0; i <= R_R7; ++i)
+    {
+        if (!get_be(r->file, &v, 2))
+            return 0;
+        r->reg[i] = (uint16_t)v;
+    }
+    int flags = getc(r->file);
+    if (flags != FL_POS && flags != FL_ZRO && flags != FL_NEG)
+        return 0;
+    r->flags = (uint8_t)flags;
+    if (!get_be(r->file, &v, 8))
+        return 0;
+    r->count = v;
+    return 1;
+}
+
+// Decode the next instruction. Returns 1 with rec filled in, 0 at the end
+// of the trace, or -1 if it is truncated or corrupt.
+int lc3_trace_next(lc3_trace_reader *r, lc3_trace_record *rec)
+{
+    static const uint8_t flag_codes[4] = {0, FL_POS, FL_ZRO, FL_NEG};
+    int h;
+    uint32_t v;
+    uint64_t word;
+
+    while ((h = getc(r->file)) != EOF && (h & TRACE_SYNC) == TRACE_SYNC)
+    {
+        if (h != TRACE_SYNC || !read_sync(r))
+            return -1;
+    }
+    if (h == EOF)
+        return ferror(r->file) ? -1 : 0;
+
+    uint16_t pc = r->next_pc;
+    if (h & TRACE_PC)
+    {
+        if (!get_varint(r->file, &v))
+            return -1;
+        pc += unzigzag(v);
+    }
+    r->next_pc = pc + 1;
+    if (h & TRACE_INSTR)
+    {
+        if (!get_be(r->file, &word, 2))
+            return -1;
+        r->instr[pc] = (uint16_t)word;
+    }
+
+    uint32_t changed = (h >> TRACE_REG_SHIFT) & 3;
+    if (h & TRACE_MORE_REGS)
+    {
+        if (!get_varint(r->file, &v) || v > 6)
+            return -1;
+        changed += v;
+    }
+    rec->written = 0;
+    for (uint32_t i = 0; i < changed; ++i)
+    {
+        if (!get_varint(r->file, &v))
+            return -1;
+        r->reg[v & 7] += unzigzag(v >> 3);
+        rec->written |= 1 << (v & 7);
+    }
+
+    rec->store_count = 0;
+    if (h & TRACE_STORES)
+    {
+        uint32_t count, value;
+        if (!get_varint(r->file, &count) || count > LC3_TRACE_MAX_STORES)
+            return -1;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            if (!get_varint(r->file, &v) || !get_varint(r->file, &value) || value > 0xFFFF)
+                return -1;
+            r->last_store += unzigzag(v);
+            rec->store_address[i] = r->last_store;
+            rec->store_value[i] = (uint16_t)value;
+        }
+        rec->store_count = (int)count;
+    }
+
+    if (h >> TRACE_FLAGS_SHIFT)
+        r->flags = flag_codes[h >> TRACE_FLAGS_SHIFT];
+
+    rec->index = ++r->count;
+    rec->pc = pc;
+    rec->instr = r->instr[pc];
+    memcpy(rec->reg, r->reg, sizeof(rec->reg));
+    rec->flags = r->flags;
+    return 1;
+}
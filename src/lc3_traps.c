@@ -1,60 +1,184 @@
 #include <stdio.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "lc3.h"
 
-extern uint16_t reg[R_COUNT];
-extern uint16_t memory[MEMORY_MAX];
-extern void update_flags(uint16_t r);
+void trap_getc(lc3_vm *vm)
+{
+    lc3_out_flush(vm);
+    vm->reg[R_R0] = (uint16_t)lc3_keyboard_getc(vm);
+    update_flags(vm, R_R0);
+}
+
+void trap_out(lc3_vm *vm)
+{
+    lc3_out_putc(vm, (char)vm->reg[R_R0]);
+    lc3_out_sync(vm);
+}
+
+// Narrow n words to bytes, keeping the low byte of each
+static void narrow_words(char *dst, const uint16_t *src, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low = _mm256_set1_epi16(0xFF);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        // packus works per 128-bit lane; gather the two low quadwords
+        __m256i packed = _mm256_packus_epi16(_mm256_and_si256(v, low), zero);
+        packed = _mm256_permute4x64_epi64(packed, 0xD8);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm256_castsi256_si128(packed));
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set1_epi16(0xFF);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(_mm_and_si128(v, low), zero));
+    }
+#endif
+
+    for (; i < n; ++i)
+    {
+        dst[i] = (char)src[i];
+    }
+}
 
-void trap_getc()
+// PUTSP characters of one word: the low byte, then the high byte unless it
+// is zero
+static size_t unpack_word(char *dst, uint16_t w)
 {
-    reg[R_R0] = (uint16_t)getchar();
-    update_flags(R_R0);
+    dst[0] = (char)(w & 0xFF);
+    dst[1] = (char)(w >> 8);
+    return (w >> 8) ? 2 : 1;
 }
 
-void trap_out()
+// Unpack n words of PUTSP characters into dst, which has room for 2 * n
+// bytes. Returns the bytes written.
+static size_t unpack_words(char *dst, const uint16_t *src, size_t n)
 {
-    putc((char)reg[R_R0], stdout);
-    fflush(stdout);
+    size_t i = 0, len = 0;
+
+    // While every high byte is set the words are already the characters in
+    // order on a little-endian host, so blocks copy straight through
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) & 0xAAAAAAAAu)
+        {
+            for (size_t j = i; j < i + 16; ++j)
+                len += unpack_word(dst + len, src[j]);
+            continue;
+        }
+        _mm256_storeu_si256((__m256i *)(dst + len), v);
+        len += 32;
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xAAAA)
+        {
+            for (size_t j = i; j < i + 8; ++j)
+                len += unpack_word(dst + len, src[j]);
+            continue;
+        }
+        _mm_storeu_si128((__m128i *)(dst + len), v);
+        len += 16;
+    }
+#endif
+
+    for (; i < n; ++i)
+    {
+        len += unpack_word(dst + len, src[i]);
+    }
+    return len;
 }
 
-void trap_puts()
+// PUTS and PUTSP measure the string with lc3_mem_scan (it wraps from 0xFFFF
+// to 0x0000, and without a terminator ends after one pass of memory), then
+// copy it in runs that stop at the wrap or the end of free output space.
+void trap_puts(lc3_vm *vm)
 {
-    uint16_t *c = memory + reg[R_R0];
-    while (*c)
+    uint16_t addr = vm->reg[R_R0];
+    size_t left = lc3_mem_scan(vm, addr, MEMORY_MAX);
+
+    while (left)
     {
-        putc((char)*c, stdout);
-        ++c;
+        size_t room;
+        char *dst = lc3_out_reserve(vm, &room);
+        size_t n = lc3_mem_run(addr, left < room ? left : room);
+
+        narrow_words(dst, vm->memory + addr, n);
+        lc3_out_commit(vm, n);
+        addr = (uint16_t)(addr + n);
+        left -= n;
     }
-    fflush(stdout);
+    lc3_out_sync(vm);
 }
 
-void trap_in()
+void trap_in(lc3_vm *vm)
 {
-    printf("Enter a character: ");
-    char c = getchar();
-    putc(c, stdout);
-    reg[R_R0] = (uint16_t)c;
-    update_flags(R_R0);
-    fflush(stdout);
+    static const char prompt[] = "Enter a character: ";
+    lc3_out_write(vm, prompt, sizeof(prompt) - 1);
+    lc3_out_flush(vm);
+    char c = lc3_keyboard_getc(vm);
+    lc3_out_putc(vm, c);
+    vm->reg[R_R0] = (uint16_t)c;
+    update_flags(vm, R_R0);
+    lc3_out_sync(vm);
 }
 
-void trap_putsp()
+void trap_putsp(lc3_vm *vm)
 {
-    uint16_t *c = memory + reg[R_R0];
-    while (*c)
+    uint16_t addr = vm->reg[R_R0];
+    size_t left = lc3_mem_scan(vm, addr, MEMORY_MAX);
+
+    while (left)
     {
-        char char1 = (*c) & 0xFF;
-        putc(char1, stdout);
-        char char2 = (*c) >> 8;
-        if (char2)
-            putc(char2, stdout);
-        ++c;
+        size_t room;
+        char *dst = lc3_out_reserve(vm, &room);
+        size_t n = lc3_mem_run(addr, left < room / 2 ? left : room / 2);
+
+        if (!n)
+        {
+            // A single byte left before the buffer wraps
+            char pair[2];
+            lc3_out_write(vm, pair, unpack_word(pair, vm->memory[addr]));
+            n = 1;
+        }
+        else
+        {
+            lc3_out_commit(vm, unpack_words(dst, vm->memory + addr, n));
+        }
+        addr = (uint16_t)(addr + n);
+        left -= n;
     }
-    fflush(stdout);
+    lc3_out_sync(vm);
 }
 
-void trap_halt()
+void trap_halt(lc3_vm *vm)
 {
-    puts("HALT");
-    fflush(stdout);
-}
\ No newline at end of file
+    lc3_out_write(vm, "HALT\n", 5);
+    lc3_out_flush(vm);
+    vm->status = LC3_STATUS_HALTED;
+    vm->running = 0;
+}
+
+// The built-in OS's routine for unassigned vectors: report on the guest's
+// console and halt
+void trap_bad(lc3_vm *vm)
+{
+    lc3_out_write(vm, "Unknown trap\n", 13);
+    lc3_out_flush(vm);
+    vm->status = LC3_STATUS_HALTED;
+    vm->running = 0;
+}
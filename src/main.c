@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "lc3.h"
 
 #define PRINT_ERROR(...) fprintf(stderr, "Error: " __VA_ARGS__)
@@ -10,26 +12,332 @@
         exit(1);                  \
     } while (0)
 
-int main(int argc, char *argv[])
+static void usage(const char *prog)
+{
+    PRINT_ERROR("Usage: %s [--flush=line|block|immediate] [--profile=text|json]\n"
+                "       [--sample=N|--sample-hz=HZ] [--sample-out=FILE] [--trace=FILE]\n"
+                "       [--record=FILE|--replay=FILE] [--os=FILE|builtin] <image-file1> ...\n"
+                "       %s --batch=<manifest> [--jobs=N] [--timeout=MS]\n"
+                "       %s --trace-dump=FILE\n",
+                prog, prog, prog);
+    exit(2);
+}
+
+static int parse_flush_policy(const char *name)
+{
+    if (strcmp(name, "immediate") == 0)
+        return LC3_FLUSH_IMMEDIATE;
+    if (strcmp(name, "line") == 0)
+        return LC3_FLUSH_LINE;
+    if (strcmp(name, "block") == 0)
+        return LC3_FLUSH_BLOCK;
+    return -1;
+}
+
+// Run a manifest of jobs and print, in manifest order, one line per job
+// ("job <n> <status> <instructions> <output-bytes>") followed by its output
+static int run_batch(const char *manifest, int workers, uint64_t timeout_ms)
 {
-    if (argc < 2)
+    lc3_job *jobs;
+    size_t count;
+    int result = lc3_batch_load(manifest, &jobs, &count);
+    if (result < 0)
+    {
+        EXIT_WITH_ERROR("Could not read manifest: %s\n", manifest);
+    }
+    if (result > 0)
     {
-        PRINT_ERROR("Usage: %s <image-file1> ...\n", argv[0]);
-        exit(2);
+        EXIT_WITH_ERROR("%s:%d: expected <budget> <stdin-file|-> <image> ...\n", manifest, result);
+    }
+
+    for (size_t j = 0; j < count; ++j)
+    {
+        jobs[j].timeout_ms = timeout_ms;
     }
 
     lc3_init();
+    int ok = lc3_batch_run(jobs, count, workers);
+    lc3_cleanup();
+    if (!ok)
+    {
+        EXIT_WITH_ERROR("Could not start the worker threads\n");
+    }
 
-    for (int j = 1; j < argc; ++j)
+    int failed = 0;
+    for (size_t j = 0; j < count; ++j)
     {
-        if (!lc3_load_image(argv[j]))
+        lc3_job *job = &jobs[j];
+        printf("job %zu %s %llu %zu\n", j, lc3_status_name(job->status),
+               (unsigned long long)job->instr_count, job->output_len);
+        fwrite(job->output, 1, job->output_len, stdout);
+        if (job->output_len)
+            putchar('\n');
+        failed |= job->status != LC3_STATUS_HALTED;
+    }
+
+    lc3_batch_free(jobs, count);
+    return failed;
+}
+
+// Pick up "prog.sym" next to "prog.obj" if the assembler left one
+static void load_symbols_for(lc3_vm *vm, const char *image)
+{
+    size_t len = strlen(image);
+    char *path = malloc(len + 5);
+    if (!path)
+        return;
+    memcpy(path, image, len + 1);
+    char *dot = strrchr(path, '.');
+    if (dot && !strchr(dot, '/'))
+        *dot = '\0';
+    strcat(path, ".sym");
+    lc3_symbols_load(vm, path);
+    free(path);
+}
+
+// Write folded stacks for flamegraph.pl and list the hottest PCs
+static void finish_sampling(lc3_vm *vm, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f || !lc3_sampler_write_folded(vm, f))
+    {
+        PRINT_ERROR("Could not write samples to %s\n", path);
+    }
+    if (f)
+        fclose(f);
+    lc3_sampler_report(vm, stderr, 10);
+}
+
+// Print a trace one instruction per line: count, PC, instruction word, then
+// the registers, condition code and memory it changed
+static int dump_trace(const char *path)
+{
+    lc3_trace_reader *r = lc3_trace_open(path);
+    if (!r)
+    {
+        EXIT_WITH_ERROR("Could not read trace: %s\n", path);
+    }
+
+    lc3_trace_record rec;
+    uint8_t flags = 0;
+    int result;
+    while ((result = lc3_trace_next(r, &rec)) > 0)
+    {
+        printf("%llu x%04X %04X", (unsigned long long)rec.index, rec.pc, rec.instr);
+        for (int i = 0; i < 8; ++i)
+        {
+            if (rec.written & (1 << i))
+                printf(" R%d=x%04X", i, rec.reg[i]);
+        }
+        if (rec.flags != flags)
+            printf(" %c", rec.flags == FL_NEG ? 'N' : rec.flags == FL_ZRO ? 'Z' : 'P');
+        flags = rec.flags;
+        for (int i = 0; i < rec.store_count; ++i)
+        {
+            printf(" [x%04X]=x%04X", rec.store_address[i], rec.store_value[i]);
+        }
+        putchar('\n');
+    }
+    lc3_trace_close(r);
+    if (result < 0)
+    {
+        EXIT_WITH_ERROR("Trace is truncated or corrupt: %s\n", path);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    // Line-buffer a terminal, block-buffer pipes and files
+    int flush_policy = isatty(STDOUT_FILENO) ? LC3_FLUSH_LINE : LC3_FLUSH_BLOCK;
+    int first_image = 1;
+    const char *manifest = NULL;
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t timeout_ms = 0;
+    int profile = -1; // -1 off, 0 text, 1 json
+    uint64_t sample_every = 0;
+    int sample_hz = 0;
+    const char *sample_out = "lc3.folded";
+    const char *trace_path = NULL;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    const char *os_image = NULL;
+
+    for (; first_image < argc && strncmp(argv[first_image], "--", 2) == 0; ++first_image)
+    {
+        const char *arg = argv[first_image];
+        if (strncmp(arg, "--flush=", 8) == 0)
+        {
+            flush_policy = parse_flush_policy(arg + 8);
+            if (flush_policy < 0)
+                usage(argv[0]);
+        }
+        else if (strncmp(arg, "--batch=", 8) == 0)
+        {
+            manifest = arg + 8;
+        }
+        else if (strncmp(arg, "--jobs=", 7) == 0)
+        {
+            workers = atoi(arg + 7);
+            if (workers < 1)
+                usage(argv[0]);
+        }
+        else if (strncmp(arg, "--profile=", 10) == 0)
+        {
+#ifndef LC3_PROFILE
+            EXIT_WITH_ERROR("--profile needs a build with -DLC3_PROFILE=ON\n");
+#endif
+            if (strcmp(arg + 10, "text") == 0)
+                profile = 0;
+            else if (strcmp(arg + 10, "json") == 0)
+                profile = 1;
+            else
+                usage(argv[0]);
+        }
+        else if (strncmp(arg, "--sample=", 9) == 0)
+        {
+            sample_every = strtoull(arg + 9, NULL, 10);
+            if (!sample_every)
+                usage(argv[0]);
+        }
+        else if (strncmp(arg, "--sample-hz=", 12) == 0)
+        {
+            sample_hz = atoi(arg + 12);
+            if (sample_hz < 1)
+                usage(argv[0]);
+        }
+        else if (strncmp(arg, "--sample-out=", 13) == 0)
+        {
+            sample_out = arg + 13;
+        }
+        else if (strncmp(arg, "--timeout=", 10) == 0)
+        {
+            timeout_ms = strtoull(arg + 10, NULL, 10);
+        }
+        else if (strncmp(arg, "--trace=", 8) == 0)
+        {
+            trace_path = arg + 8;
+        }
+        else if (strncmp(arg, "--record=", 9) == 0)
+        {
+            record_path = arg + 9;
+        }
+        else if (strncmp(arg, "--replay=", 9) == 0)
+        {
+            replay_path = arg + 9;
+        }
+        else if (strncmp(arg, "--os=", 5) == 0)
+        {
+            os_image = arg + 5;
+        }
+        else if (strncmp(arg, "--trace-dump=", 13) == 0)
+        {
+            return dump_trace(arg + 13);
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+
+    if (manifest)
+    {
+        if (first_image != argc)
+            usage(argv[0]);
+        return run_batch(manifest, workers, timeout_ms);
+    }
+
+    if (first_image >= argc || (record_path && replay_path))
+    {
+        usage(argv[0]);
+    }
+
+    lc3_vm *vm = lc3_create();
+    if (!vm)
+    {
+        EXIT_WITH_ERROR("Out of memory\n");
+    }
+    lc3_out_init(vm, STDOUT_FILENO, flush_policy);
+
+    // The OS goes in first so that programs may replace parts of it
+    if (os_image)
+    {
+        int ok = strcmp(os_image, "builtin") == 0 ? lc3_os_install(vm)
+                                                  : lc3_load_image(vm, os_image) && lc3_os_enable(vm);
+        if (!ok)
+        {
+            EXIT_WITH_ERROR("Failed to load OS image: %s\n", os_image);
+        }
+    }
+
+    for (int j = first_image; j < argc; ++j)
+    {
+        if (!lc3_load_image(vm, argv[j]))
         {
             EXIT_WITH_ERROR("Failed to load image: %s\n", argv[j]);
         }
     }
 
-    lc3_run();
+    int sampling = sample_every || sample_hz;
+    if (sampling)
+    {
+        if (!lc3_sampler_enable(vm, sample_every))
+        {
+            EXIT_WITH_ERROR("Out of memory\n");
+        }
+        for (int j = first_image; j < argc; ++j)
+        {
+            load_symbols_for(vm, argv[j]);
+        }
+        if (sample_hz && !lc3_sample_timer(sample_hz))
+        {
+            EXIT_WITH_ERROR("Could not start the sampling timer\n");
+        }
+    }
+
+    if (trace_path && !lc3_trace_start(vm, trace_path))
+    {
+        EXIT_WITH_ERROR("Could not write trace: %s\n", trace_path);
+    }
+
+    if (record_path && !lc3_record_input(vm, record_path))
+    {
+        EXIT_WITH_ERROR("Could not write input log: %s\n", record_path);
+    }
+    if (replay_path && !lc3_replay_input(vm, replay_path))
+    {
+        EXIT_WITH_ERROR("Could not read input log: %s\n", replay_path);
+    }
+
+    lc3_init();
+    // A replay reads nothing from stdin
+    if (!replay_path && !lc3_in_start(vm, STDIN_FILENO))
+    {
+        EXIT_WITH_ERROR("Could not start the input reader\n");
+    }
+    lc3_run(vm);
     lc3_cleanup();
+    if ((record_path || replay_path) && !lc3_input_log_close(vm))
+    {
+        if (record_path)
+            PRINT_ERROR("Could not write all of the input log to %s\n", record_path);
+        else
+            PRINT_ERROR("The program did not read its input as recorded in %s\n", replay_path);
+    }
+    if (trace_path && !lc3_trace_stop(vm))
+    {
+        PRINT_ERROR("Could not write all of the trace to %s\n", trace_path);
+    }
+    if (sampling)
+    {
+        lc3_sample_timer(0);
+        finish_sampling(vm, sample_out);
+    }
+    if (profile >= 0)
+    {
+        lc3_profile_report(vm, stderr, profile);
+    }
+    lc3_destroy(vm);
 
     return 0;
-}
\ No newline at end of file
+}
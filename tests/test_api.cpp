@@ -0,0 +1,141 @@
+// Smoke test of the embedding API through lc3::Vm: running, moving the VM,
+// swapping callbacks while output is pending, forking, registers and memory.
+
+#include <cstdio>
+#include <string>
+#include <utility>
+
+#include "lc3_api.hpp"
+
+static int failures;
+
+#define CHECK(cond)                                                        \
+    do                                                                     \
+    {                                                                      \
+        if (!(cond))                                                       \
+        {                                                                  \
+            std::fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+// At x3000: LEA R0,MSG; PUTS; GETC; OUT; HALT; MSG .STRINGZ "Hi\n"
+static const unsigned char program[] = {
+    0x30, 0x00,
+    0xE0, 0x04, 0xF0, 0x22, 0xF0, 0x20, 0xF0, 0x21, 0xF0, 0x25,
+    0x00, 'H', 0x00, 'i', 0x00, '\n', 0x00, 0x00,
+};
+
+// Step until the guest reaches pc, giving up after a generous limit
+static bool step_to(lc3::Vm &vm, uint16_t pc)
+{
+    for (int i = 0; i < 100000 && vm.pc() != pc; i++)
+    {
+        if (vm.step() != LC3_STATUS_PAUSED)
+            return false;
+    }
+    return vm.pc() == pc;
+}
+
+static void test_take_output()
+{
+    lc3::Vm vm;
+    CHECK(vm.load(program, sizeof program));
+    vm.push_input("x");
+    vm.close_input();
+    CHECK(vm.run_for(1000000) == LC3_STATUS_HALTED);
+    std::string out = vm.take_output();
+    CHECK(out.compare(0, 4, "Hi\nx") == 0);
+    CHECK(vm.take_output().empty());
+}
+
+static void test_move_and_swap_callbacks()
+{
+    std::string first, second;
+    lc3::Vm a;
+    CHECK(a.load(program, sizeof program));
+    a.on_output([&](const char *d, size_t n) { first.append(d, n); });
+
+    // The callback's context must survive the move
+    lc3::Vm b(std::move(a));
+    CHECK(a.get() == nullptr);
+    CHECK(step_to(b, 0x3002));
+    CHECK(first == "Hi\n");
+
+    b.on_output([&](const char *d, size_t n) { second.append(d, n); });
+    b.on_input([]() { return 'y'; });
+
+    lc3::Vm c;
+    c = std::move(b);
+    CHECK(c.run_for(1000000) == LC3_STATUS_HALTED);
+    CHECK(first == "Hi\n");
+    CHECK(second.compare(0, 1, "y") == 0);
+
+    // Back to keeping output, with fresh input, on the same VM
+    c.on_output(nullptr);
+    c.reset();
+    c.reset_input();
+    CHECK(c.load(program, sizeof program));
+    c.push_input("z");
+    CHECK(c.run_for(1000000) == LC3_STATUS_HALTED);
+    CHECK(c.take_output().compare(0, 4, "Hi\nz") == 0);
+}
+
+static void test_fork()
+{
+    std::string seen;
+    lc3::Vm parent;
+    CHECK(parent.load(program, sizeof program));
+    parent.on_output([&](const char *d, size_t n) { seen.append(d, n); });
+
+    // Through the C API the child shares the parent's callback
+    lc3_vm *child = lc3_fork(parent.get());
+    CHECK(child != nullptr);
+    if (child)
+    {
+        lc3_in_push(child, "c", 1);
+        CHECK(lc3_run_for(child, 1000000) == LC3_STATUS_HALTED);
+        CHECK(seen.compare(0, 4, "Hi\nc") == 0);
+        lc3_destroy(child);
+    }
+    CHECK(parent.pc() == 0x3000);
+
+    // lc3::Vm::fork gives the child its own copy, which outlives the parent
+    seen.clear();
+    lc3::Vm copy = parent.fork();
+    parent = lc3::Vm();
+    copy.push_input("d");
+    CHECK(copy.run_for(1000000) == LC3_STATUS_HALTED);
+    CHECK(seen.compare(0, 4, "Hi\nd") == 0);
+}
+
+static void test_registers_and_memory()
+{
+    lc3::Vm vm;
+    vm.set_reg(3, 0x1234);
+    CHECK(vm.reg(3) == 0x1234);
+    vm.set_pc(0x4000);
+    CHECK(vm.pc() == 0x4000);
+    vm.set_reg(LC3_REG_COND, 4);
+    CHECK(vm.reg(LC3_REG_COND) == 4);
+    CHECK((vm.reg(LC3_REG_PSR) & 7) == 4);
+
+    uint16_t w[3] = {0x41, 0x42, 0x43};
+    vm.write(0xFFFE, w, 3);
+    CHECK(vm.peek(0xFFFE) == 0x41 && vm.peek(0xFFFF) == 0x42 && vm.peek(0) == 0x43);
+    uint16_t r[3];
+    vm.read(0xFFFE, r, 3);
+    CHECK(r[0] == 0x41 && r[1] == 0x42 && r[2] == 0x43);
+}
+
+int main()
+{
+    test_take_output();
+    test_move_and_swap_callbacks();
+    test_fork();
+    test_registers_and_memory();
+    if (failures)
+        return 1;
+    std::puts("ok");
+    return 0;
+}
@@ -0,0 +1,67 @@
+// Block-buffered output must reach the host within about LC3_OUT_FLUSH_MS
+// even when the guest prints once and never produces output again.
+
+#include <stdio.h>
+#include <time.h>
+
+#include "lc3.h"
+
+#define RUN_MS 1000
+#define SLACK_MS 200
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t arrived_ms;
+
+static void on_output(void *ctx, const char *data, size_t len)
+{
+    (void)ctx;
+    (void)data;
+    (void)len;
+    if (!arrived_ms)
+        arrived_ms = now_ms();
+}
+
+int main(void)
+{
+    static const uint16_t program[] = {
+        0x2002, // x3000 LD R0, x3003
+        0xF021, // x3001 OUT
+        0x0FFF, // x3002 BRnzp x3002
+        'A',
+    };
+    int failures = 0;
+    lc3_vm *vm = lc3_create();
+
+    if (!vm)
+        return 1;
+    lc3_set_output(vm, on_output, NULL);
+    vm->out.policy = LC3_FLUSH_BLOCK;
+    lc3_mem_write_block(vm, 0x3000, program, sizeof(program) / sizeof(program[0]));
+    lc3_set_reg(vm, LC3_REG_PC, 0x3000);
+
+    uint64_t start = now_ms();
+    lc3_set_timeout(vm, RUN_MS);
+    int status = lc3_run_for(vm, UINT64_MAX);
+    if (status != LC3_STATUS_DEADLINE)
+    {
+        fprintf(stderr, "status %s, expected deadline\n", lc3_status_name(status));
+        failures++;
+    }
+    if (!arrived_ms || arrived_ms - start > LC3_OUT_FLUSH_MS + SLACK_MS)
+    {
+        fprintf(stderr, "output arrived after %llu ms, expected within %d ms\n",
+                (unsigned long long)(arrived_ms - start), LC3_OUT_FLUSH_MS + SLACK_MS);
+        failures++;
+    }
+    lc3_destroy(vm);
+    if (failures)
+        return 1;
+    puts("ok");
+    return 0;
+}
@@ -0,0 +1,139 @@
+// Input recorded on the reference loop, one lc3_step at a time, must replay
+// on every engine and slicing while a keyboard interrupt handler consumes
+// it: both engines take interrupts at the same instructions.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lc3.h"
+
+#define LOG_PATH "test_replay.log"
+
+static int failures;
+
+#define CHECK(cond)                                                        \
+    do                                                                     \
+    {                                                                      \
+        if (!(cond))                                                       \
+        {                                                                  \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);     \
+            failures++;                                                    \
+        }                                                                  \
+    } while (0)
+
+typedef struct
+{
+    char out[64];
+    uint16_t r1;
+    uint64_t count;
+    int status;
+} result;
+
+// The main loop counts in R1 until the handler at x4000 has echoed three
+// keys; the handler runs on the supervisor stack at xF000
+static lc3_vm *guest(void)
+{
+    static const uint16_t main_loop[] = {
+        0x2007, // x3000 LD R0, x3008
+        0xB007, // x3001 STI R0, x3009 (KBSR)
+        0x1261, // x3002 ADD R1, R1, #1
+        0x0000, // x3003 NOP
+        0x1B3D, // x3004 ADD R5, R4, #-3
+        0x09FC, // x3005 BRn x3002
+        0xF025, // x3006 HALT
+        0x0000,
+        KBSR_IE,
+        MR_KBSR,
+    };
+    static const uint16_t handler[] = {
+        0xA003, // x4000 LDI R0, x4004 (KBDR)
+        0xF021, // x4001 OUT
+        0x1921, // x4002 ADD R4, R4, #1
+        0x8000, // x4003 RTI
+        MR_KBDR,
+    };
+
+    lc3_vm *vm = lc3_create();
+    if (!vm)
+        return NULL;
+    lc3_set_output(vm, NULL, NULL);
+    lc3_mem_write_block(vm, 0x3000, main_loop, sizeof(main_loop) / sizeof(main_loop[0]));
+    lc3_mem_write_block(vm, 0x4000, handler, sizeof(handler) / sizeof(handler[0]));
+    uint16_t vector = 0x4000;
+    lc3_mem_write_block(vm, 0x0180, &vector, 1);
+    lc3_set_reg(vm, R_R6, 0xF000);
+    // A replay that diverges may never halt
+    vm->instr_limit = 100000;
+    return vm;
+}
+
+static void finish(lc3_vm *vm, result *r)
+{
+    size_t len;
+    char *out = lc3_out_take(vm, &len);
+    memset(r, 0, sizeof(*r));
+    if (out && len < sizeof(r->out))
+        memcpy(r->out, out, len);
+    free(out);
+    r->r1 = lc3_get_reg(vm, R_R1);
+    r->count = lc3_instr_count(vm);
+    r->status = lc3_status(vm);
+}
+
+static void check_replay(const result *want, void (*engine)(lc3_vm *), uint64_t slice, const char *name)
+{
+    lc3_vm *vm = guest();
+    result got;
+
+    CHECK(vm && lc3_replay_input(vm, LOG_PATH));
+    if (!vm)
+        return;
+    if (engine)
+        engine(vm);
+    else
+        while (lc3_run_for(vm, slice) == LC3_STATUS_PAUSED)
+            ;
+    CHECK(lc3_input_log_close(vm));
+    finish(vm, &got);
+    if (strcmp(got.out, want->out) != 0 || got.r1 != want->r1 || got.count != want->count ||
+        got.status != want->status)
+    {
+        fprintf(stderr, "%s: [%s] R1=%u count=%llu, recorded [%s] R1=%u count=%llu\n", name, got.out,
+                got.r1, (unsigned long long)got.count, want->out, want->r1,
+                (unsigned long long)want->count);
+        failures++;
+    }
+    lc3_destroy(vm);
+}
+
+int main(void)
+{
+    lc3_vm *vm = guest();
+    result want;
+
+    CHECK(vm && lc3_record_input(vm, LOG_PATH));
+    if (!vm)
+        return 1;
+    lc3_in_push(vm, "abc", 3);
+    while (lc3_step(vm) == LC3_STATUS_PAUSED)
+        ;
+    CHECK(lc3_input_log_close(vm));
+    finish(vm, &want);
+    lc3_destroy(vm);
+    CHECK(want.status == LC3_STATUS_HALTED);
+    CHECK(strncmp(want.out, "abc", 3) == 0);
+
+    check_replay(&want, lc3_run_switch, 0, "switch");
+#ifdef LC3_HAVE_THREADED_DISPATCH
+    check_replay(&want, lc3_run_threaded, 0, "threaded");
+#endif
+    check_replay(&want, NULL, 7, "run_for(7)");
+    check_replay(&want, NULL, 1000000, "run_for");
+
+    remove(LOG_PATH);
+    if (failures)
+        return 1;
+    puts("ok");
+    return 0;
+}